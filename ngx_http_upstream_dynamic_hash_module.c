@@ -1,5 +1,81 @@
 #include <ngx_http.h>
 #include <unistd.h>
+#include <math.h>
+#include <ngx_http_upstream_hash_key.h>
+
+#if (NGX_HTTP_UPSTREAM_HASH_CHECK)
+#include <ngx_http_upstream_hash_check_module.h>
+#endif
+
+/*
+ * x86 builds carry an AVX2 and an SSE2 scoring loop whatever the -m flags,
+ * the AVX2 one is compiled for its target by attribute and only used when
+ * the CPU has it; compilers that lack per-function targets keep the plain C
+ */
+
+#if (defined(__x86_64__) || defined(__i386__))                               \
+    && (defined(__clang__) || __GNUC__ >= 5)
+#define NGX_HTTP_UPSTREAM_DYNAMIC_HASH_X86  1
+#include <immintrin.h>
+#else
+#define NGX_HTTP_UPSTREAM_DYNAMIC_HASH_X86  0
+#endif
+
+
+/*
+ * Maglev needs a prime table size so that every skip value is coprime with
+ * it; the automatic size keeps at least 100 slots per backend, which holds
+ * the per-backend share within about 1% of its weight.
+ */
+#define NGX_HTTP_UPSTREAM_DYNAMIC_HASH_MIN_SIZE      65537
+#define NGX_HTTP_UPSTREAM_DYNAMIC_HASH_MAX_SIZE      16777213
+#define NGX_HTTP_UPSTREAM_DYNAMIC_HASH_SLOTS_PER     100
+
+/* scale the upper 32 bits of a 64-bit key hash onto [0, size) */
+#define ngx_http_upstream_dynamic_hash_reduce(hash, size)                    \
+    (ngx_uint_t) ((((uint64_t) (hash) >> 32) * (size)) >> 32)
+
+#define NGX_HTTP_UPSTREAM_DYNAMIC_HASH_LEGACY        0
+#define NGX_HTTP_UPSTREAM_DYNAMIC_HASH_XXH64         1
+#define NGX_HTTP_UPSTREAM_DYNAMIC_HASH_SIPHASH       2
+
+/* "jump" and "rendezvous" keep no table: peers->table is NULL */
+#define NGX_HTTP_UPSTREAM_DYNAMIC_HASH_MAGLEV        0
+#define NGX_HTTP_UPSTREAM_DYNAMIC_HASH_JUMP          1
+#define NGX_HTTP_UPSTREAM_DYNAMIC_HASH_RENDEZVOUS    2
+
+/*
+ * slow_start: the weight in effect, in thousandths of the configured one,
+ * starts at one step and grows with the time since the backend came in
+ */
+#define NGX_HTTP_UPSTREAM_DYNAMIC_HASH_RAMP_FULL     1000
+#define NGX_HTTP_UPSTREAM_DYNAMIC_HASH_RAMP_STEPS    10
+
+#define ngx_http_upstream_dynamic_hash_ramp_tick(uhcf)                       \
+    ngx_max((uhcf)->slow_start / NGX_HTTP_UPSTREAM_DYNAMIC_HASH_RAMP_STEPS, 100)
+
+/* table slots hold an index into peers->peer[] */
+#define NGX_HTTP_UPSTREAM_DYNAMIC_HASH_MAX_PEERS     65535
+
+typedef uint16_t  ngx_http_upstream_dynamic_hash_slot_t;
+
+/* per worker log2 histograms of selection and key evaluation time */
+#define NGX_HTTP_UPSTREAM_DYNAMIC_HASH_BUCKETS       64
+#define NGX_HTTP_UPSTREAM_DYNAMIC_HASH_SELECT        0
+#define NGX_HTTP_UPSTREAM_DYNAMIC_HASH_KEY           1
+
+typedef struct ngx_http_upstream_dynamic_hash_stats_s
+    ngx_http_upstream_dynamic_hash_stats_t;
+
+struct ngx_http_upstream_dynamic_hash_stats_s {
+    ngx_atomic_t                              hist[2][NGX_HTTP_UPSTREAM_DYNAMIC_HASH_BUCKETS];
+    ngx_uint_t                                worker;
+    ngx_http_upstream_dynamic_hash_stats_t   *next;
+};
+
+#define ngx_bitvector_index(index) (index / (8 * sizeof(uintptr_t)))
+#define ngx_bitvector_bit(index) ((uintptr_t) 1 << (index % (8 * sizeof(uintptr_t))))
+
 
 typedef struct {
     struct sockaddr                *sockaddr;
@@ -7,55 +83,253 @@ typedef struct {
     ngx_str_t                       name;
     ngx_uint_t                      down;
     ngx_int_t                       weight;
+
+    /* shared by all workers when the peers are in a zone */
+    ngx_atomic_t                    fails;
+    ngx_atomic_t                    until;      /* skipped until then */
+
+    ngx_uint_t                      max_fails;
+    time_t                          fail_timeout;
+
+    ngx_uint_t                      removed;
+    ngx_uint_t                      unhealthy;  /* by hash_check, no share */
+    ngx_uint_t                      ramp;       /* slow_start, thousandths */
+    ngx_msec_t                      ramp_start;
+#if (NGX_HTTP_UPSTREAM_HASH_CHECK)
+    ngx_int_t                       check;      /* hash_check index */
+#endif
+
+    ngx_uint_t                      offset;
+    ngx_uint_t                      skip;
+
+    ngx_atomic_t                    conns;      /* in flight, all workers */
 } ngx_http_upstream_dynamic_hash_peer_t;
 
 typedef struct {
-  ngx_array_t  *values;
-  ngx_array_t  *lengths;
+  ngx_http_upstream_hash_key_t  key;
+  ngx_flag_t    per_connection;
+  ngx_uint_t    table_size;
+  ngx_shm_zone_t               *shm_zone;
+  ngx_http_upstream_srv_conf_t *upstream;
+  ngx_flag_t                    stats;
+  ngx_uint_t                    hash;
+  ngx_uint_t                    algorithm;
+  ngx_uint_t                    bounded_load;
+  ngx_msec_t                    slow_start;
+  u_char                        hash_key[16];
+  ngx_http_upstream_dynamic_hash_stats_t *worker_stats;
+#if (NGX_HTTP_SSL)
+  ngx_ssl_session_t           **ssl_sessions;   /* local to a process */
+#endif
 } ngx_http_upstream_dynamic_hash_conf_t;
 
-typedef struct {
+/*
+ * With a zone the peers live in shared memory: "number" slots of peer[] are
+ * in use (removed ones included) out of "capacity", and "table" points to
+ * one of the two "tables" buffers.
+ */
+
+typedef struct ngx_http_upstream_dynamic_hash_peers_s
+    ngx_http_upstream_dynamic_hash_peers_t;
+
+struct ngx_http_upstream_dynamic_hash_peers_s {
     ngx_uint_t                        number;
+    ngx_uint_t                        capacity;
     ngx_uint_t                        total_weight;
+    ngx_uint_t                        live;          /* selectable peers */
+    uint64_t                          live_weight;   /* their weight * ramp */
+    ngx_uint_t                        table_size;
+    ngx_uint_t                        algorithm;
+    ngx_uint_t                        bounded_load;  /* epsilon, percent */
+    ngx_msec_t                        slow_start;
+    ngx_atomic_t                      conns;
     unsigned                          weighted:1;
-    ngx_http_upstream_dynamic_hash_peer_t     peer[53];
-} ngx_http_upstream_dynamic_hash_peers_t;
+    unsigned                          rebuild:1;
+    ngx_atomic_t                      generation;
+    ngx_slab_pool_t                  *shpool;
+    ngx_http_upstream_dynamic_hash_stats_t   *stats;
+    ngx_http_upstream_dynamic_hash_slot_t    *tables[2];
+    ngx_http_upstream_dynamic_hash_slot_t    *table;
+    uint32_t                                 *seeds;      /* rendezvous */
+    ngx_http_upstream_dynamic_hash_peers_t   *next;       /* backup tier */
+    ngx_http_upstream_dynamic_hash_peer_t     peer[0];
+};
+
+/* key hash kept in the client connection pool, one per upstream */
+
+typedef struct {
+    ngx_http_upstream_dynamic_hash_conf_t      *conf;
+    uint64_t                                    key;
+} ngx_http_upstream_dynamic_hash_memo_t;
 
 typedef struct {
     ngx_http_upstream_dynamic_hash_peers_t     *peers;
 
-    int	                               hash;
+    ngx_uint_t                         hash;
+    uint64_t                           key;
+
+    ngx_uint_t                         current;
+    ngx_http_upstream_dynamic_hash_peers_t     *tier;   /* of current */
 
-    u_char                             addr[3];
+    ngx_http_upstream_dynamic_hash_stats_t  *stats;
 
-    u_char                             tries;
+    uint32_t                          *scores;
+    uintptr_t                         *seen;    /* live peers a walk met */
 
-    ngx_event_get_peer_pt              get_rr_peer;
+    unsigned                           counted:1;
+    unsigned                           backup:1;
+
+#if (NGX_HTTP_SSL)
+    ngx_ssl_session_t                **ssl_sessions;
+#endif
+
+    /* primary bits, then backup bits from backup_tried() on */
+    uintptr_t                          tried[1];
 } ngx_http_upstream_dynamic_hash_peer_data_t;
 
+#define ngx_http_upstream_dynamic_hash_backup_tried(iphp)                    \
+    (&(iphp)->tried[ngx_bitvector_index((iphp)->peers->capacity) + 1])
+
+#if (NGX_HTTP_UPSTREAM_HASH_CHECK)
+#define ngx_http_upstream_dynamic_hash_check_down(peer)                      \
+    ((peer)->check != NGX_DECLINED                                           \
+     && ngx_http_upstream_hash_check_peer_down((peer)->check))
+#else
+#define ngx_http_upstream_dynamic_hash_check_down(peer)  0
+#endif
+
+static ngx_int_t ngx_http_upstream_dynamic_hash_init_tier(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us, ngx_uint_t backup,
+    ngx_http_upstream_dynamic_hash_peers_t **tier);
 static ngx_int_t ngx_http_upstream_init_dynamic_hash_peer(ngx_http_request_t *r,
                                                           ngx_http_upstream_srv_conf_t *us);
 static ngx_int_t ngx_http_upstream_get_dynamic_hash_peer(ngx_peer_connection_t *pc,
                                                          void *data);
+static void ngx_http_upstream_free_dynamic_hash_peer(ngx_peer_connection_t *pc,
+                                                     void *data, ngx_uint_t state);
+#if (NGX_HTTP_SSL)
+static ngx_int_t ngx_http_upstream_set_dynamic_hash_peer_session(
+    ngx_peer_connection_t *pc, void *data);
+static void ngx_http_upstream_save_dynamic_hash_peer_session(
+    ngx_peer_connection_t *pc, void *data);
+#endif
 static char *ngx_http_upstream_dynamic_hash(ngx_conf_t *cf, ngx_command_t *cmd,
                                             void *conf);
 static void * ngx_http_upstream_dynamic_hash_create_srv_conf(ngx_conf_t *cf);
+static ngx_int_t ngx_http_upstream_dynamic_hash_conn_key(ngx_http_request_t *r,
+    ngx_http_upstream_dynamic_hash_conf_t *uhcf, uint64_t *key);
+static void ngx_http_upstream_dynamic_hash_memo_cleanup(void *data);
 
 static int h1(char* str, int len);
 static int h2(char* str, int len);
-static void getPermutation(int** permutation, int m, int n, char** name);
-static void init_peers(int row, int col, int* weight, char** name, int* entry);
-static void print_sockaddr(ngx_log_t *log, struct sockaddr *ip);
+static int ngx_http_upstream_dynamic_hash_abs(uint32_t hash);
+static uint64_t ngx_http_upstream_dynamic_hash_key(
+    ngx_http_upstream_dynamic_hash_conf_t *uhcf, u_char *data, size_t len);
+static uint64_t ngx_http_upstream_dynamic_hash_xxh64(u_char *p, size_t len,
+    uint64_t seed);
+static uint64_t ngx_http_upstream_dynamic_hash_siphash(u_char *p, size_t len,
+    u_char *key);
+static ngx_int_t init_peers(int row, int col, uint64_t* weight,
+    ngx_uint_t* quota, int* offset, int* skip, int* entry);
+static ngx_uint_t ngx_http_upstream_dynamic_hash_jump(uint64_t key,
+    ngx_uint_t buckets);
+static uint32_t ngx_http_upstream_dynamic_hash_rendezvous_seed(
+    ngx_http_upstream_dynamic_hash_peer_t *peer);
+static void ngx_http_upstream_dynamic_hash_scores(uint32_t *seeds,
+    ngx_uint_t n, uint32_t key, uint32_t *scores);
+#if (NGX_HTTP_UPSTREAM_DYNAMIC_HASH_X86)
+static ngx_uint_t ngx_http_upstream_dynamic_hash_scores_avx2(uint32_t *seeds,
+    ngx_uint_t n, uint32_t key, uint32_t *scores)
+    __attribute__((target("avx2")));
+#if defined(__SSE2__)
+static ngx_uint_t ngx_http_upstream_dynamic_hash_scores_sse2(uint32_t *seeds,
+    ngx_uint_t n, uint32_t key, uint32_t *scores);
+#endif
+#endif
+static ngx_uint_t ngx_http_upstream_dynamic_hash_position(
+    ngx_http_upstream_dynamic_hash_peers_t *peers, uint64_t key);
+static void ngx_http_upstream_dynamic_hash_live(
+    ngx_http_upstream_dynamic_hash_peers_t *peers);
+static ngx_int_t ngx_http_upstream_dynamic_hash_walk_stable(
+    ngx_http_upstream_dynamic_hash_peer_data_t *iphp,
+    ngx_http_upstream_dynamic_hash_peers_t *peers, uintptr_t *tried,
+    time_t now);
+static ngx_int_t ngx_http_upstream_dynamic_hash_walk(
+    ngx_http_upstream_dynamic_hash_peer_data_t *iphp,
+    ngx_http_upstream_dynamic_hash_peers_t *peers, uintptr_t *tried,
+    time_t now);
+static ngx_int_t ngx_http_upstream_get_rendezvous_peer(
+    ngx_http_upstream_dynamic_hash_peer_data_t *iphp,
+    ngx_http_upstream_dynamic_hash_peers_t *peers, uintptr_t *tried,
+    time_t now);
+static ngx_inline ngx_uint_t ngx_http_upstream_dynamic_hash_failed(
+    ngx_http_upstream_dynamic_hash_peer_t *peer);
+static ngx_uint_t ngx_http_upstream_dynamic_hash_probe(
+    ngx_http_upstream_dynamic_hash_peer_t *peer, time_t now);
+static ngx_uint_t ngx_http_upstream_dynamic_hash_overloaded(
+    ngx_http_upstream_dynamic_hash_peers_t *peers,
+    ngx_http_upstream_dynamic_hash_peer_t *peer);
+static ngx_uint_t ngx_http_upstream_dynamic_hash_is_prime(ngx_uint_t n);
+static ngx_uint_t ngx_http_upstream_dynamic_hash_table_size(ngx_uint_t n);
+static ngx_int_t ngx_http_upstream_dynamic_hash_build(
+    ngx_http_upstream_dynamic_hash_peers_t *peers,
+    ngx_http_upstream_dynamic_hash_slot_t *table);
+static ngx_int_t ngx_http_upstream_dynamic_hash_update(
+    ngx_http_upstream_dynamic_hash_peers_t *peers,
+    ngx_http_upstream_dynamic_hash_slot_t *old,
+    ngx_http_upstream_dynamic_hash_slot_t *table);
+static ngx_int_t ngx_http_upstream_dynamic_hash_quota(
+    ngx_http_upstream_dynamic_hash_peers_t *peers, ngx_uint_t *quota);
+static void ngx_http_upstream_dynamic_hash_seed(
+    ngx_http_upstream_dynamic_hash_peer_t *peer, ngx_uint_t size);
+static void ngx_http_upstream_dynamic_hash_identity(
+    ngx_http_upstream_dynamic_hash_peer_t *peer, char *name);
+static ngx_int_t ngx_http_upstream_dynamic_hash_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+static char *ngx_http_upstream_dynamic_hash_admin(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_upstream_dynamic_hash_admin_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_upstream_dynamic_hash_parse_addr(ngx_pool_t *pool,
+    ngx_str_t *text, ngx_addr_t *addr);
+static ngx_int_t ngx_http_upstream_dynamic_hash_find_peer(
+    ngx_http_upstream_dynamic_hash_peers_t *peers, ngx_addr_t *addr);
+static void ngx_http_upstream_dynamic_hash_slots(
+    ngx_http_upstream_dynamic_hash_peers_t *peers, ngx_uint_t *slots);
+static ngx_int_t ngx_http_upstream_dynamic_hash_init_process(ngx_cycle_t *cycle);
+static void ngx_http_upstream_dynamic_hash_ramp_up(
+    ngx_http_upstream_dynamic_hash_peers_t *peers,
+    ngx_http_upstream_dynamic_hash_peer_t *peer);
+static void ngx_http_upstream_dynamic_hash_ramp_handler(ngx_event_t *ev);
+#if (NGX_HTTP_UPSTREAM_HASH_CHECK)
+static void ngx_http_upstream_dynamic_hash_check_handler(ngx_uint_t index,
+    ngx_uint_t down, void *data);
+#endif
+static ngx_inline uint64_t ngx_http_upstream_dynamic_hash_clock(void);
+static ngx_inline void ngx_http_upstream_dynamic_hash_record(ngx_atomic_t *hist,
+    uint64_t start);
+static u_char *ngx_http_upstream_dynamic_hash_percentiles(u_char *p,
+    char *metric, ngx_http_upstream_dynamic_hash_stats_t *stats, ngx_uint_t m);
+
+#if (NGX_HTTP_UPSTREAM_DYNAMIC_HASH_X86)
+static ngx_uint_t  ngx_http_upstream_dynamic_hash_avx2;
+#endif
 
 static ngx_command_t  ngx_http_upstream_dynamic_hash_commands[] = {
 
         { ngx_string("dynamic_hash"),
-          NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+          NGX_HTTP_UPS_CONF|NGX_CONF_1MORE,
           ngx_http_upstream_dynamic_hash,
           0,
           0,
           NULL },
 
+        { ngx_string("dynamic_hash_admin"),
+          NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+          ngx_http_upstream_dynamic_hash_admin,
+          NGX_HTTP_LOC_CONF_OFFSET,
+          0,
+          NULL },
+
         ngx_null_command
 };
 
@@ -82,7 +356,7 @@ ngx_module_t  ngx_http_upstream_dynamic_hash_module = {
         NGX_HTTP_MODULE,                       /* module type */
         NULL,                                  /* init master */
         NULL,                                  /* init module */
-        NULL,                                  /* init process */
+        ngx_http_upstream_dynamic_hash_init_process, /* init process */
         NULL,                                  /* init thread */
         NULL,                                  /* exit thread */
         NULL,                                  /* exit process */
@@ -91,333 +365,3084 @@ ngx_module_t  ngx_http_upstream_dynamic_hash_module = {
 };
 
 
-ngx_int_t
-ngx_http_upstream_init_dynamic_hash(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
+/*
+ * Builds the primary or the backup tier.  The backup tier gets its own
+ * table and is only consulted once the primary one has no live candidate
+ * for a key.
+ */
+
+static ngx_int_t
+ngx_http_upstream_dynamic_hash_init_tier(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us, ngx_uint_t backup,
+    ngx_http_upstream_dynamic_hash_peers_t **tier)
 {
     ngx_http_upstream_server_t      *server;
-    char**                          server_name;
-    int*                            weight;
-    struct sockaddr_in              *ip;
-    char                            *addr_name;
-    char                            *ip_addr;
-    unsigned int                    ip_port;
-    int                             count;
-    int                             server_num;
-    int*                            entry;
-    ngx_uint_t                      col=53;
-    ngx_uint_t                      i;
+    ngx_uint_t                      count;
+    ngx_uint_t                      server_num;
+    ngx_uint_t                      col;
+    ngx_uint_t                      i, j;
     ngx_http_upstream_dynamic_hash_peers_t *peers;
-    struct timeval start, end;
-
-    gettimeofday(&start, NULL);
+    ngx_http_upstream_dynamic_hash_conf_t  *uhcf;
 
-    //fprintf(stderr, "dynamic func %s\n", "init");
-    us->peer.init = ngx_http_upstream_init_dynamic_hash_peer;
+    *tier = NULL;
 
     server = us->servers->elts;
 
+    /* every address of a server is a backend of its own */
+
     server_num=0;
     for (i=0; i<us->servers->nelts; i++) {
-        if (server[i].backup)
+        if (server[i].backup != backup)
             continue;
 
-        server_num++;
+        server_num += server[i].naddrs;
     }
 
     if (server_num == 0) {
+        return backup ? NGX_OK : NGX_ERROR;
+    }
+
+    if (server_num > NGX_HTTP_UPSTREAM_DYNAMIC_HASH_MAX_PEERS) {
+        ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                      "too many servers in dynamic_hash upstream \"%V\"",
+                      &us->host);
+        return NGX_ERROR;
+    }
+
+    uhcf = ngx_http_conf_upstream_srv_conf(us, ngx_http_upstream_dynamic_hash_module);
+
+    col = uhcf->table_size;
+
+    if (uhcf->algorithm != NGX_HTTP_UPSTREAM_DYNAMIC_HASH_MAGLEV) {
+        col = 0;
+
+    } else if (col == 0) {
+        col = ngx_http_upstream_dynamic_hash_table_size(server_num);
+
+    } else if (col <= server_num) {
+        ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                      "dynamic_hash table_size=%ui must be larger than "
+                      "the number of servers (%ui) in upstream \"%V\"",
+                      col, server_num, &us->host);
+        return NGX_ERROR;
+    }
+
+    /*
+     * every backend is stored once, the table itself only keeps
+     * small indices into peers->peer[]
+     */
+
+    peers = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_dynamic_hash_peers_t)
+                                  + sizeof(ngx_http_upstream_dynamic_hash_peer_t) * server_num);
+    if (peers == NULL) {
         return NGX_ERROR;
     }
 
-    server_name = (char **)malloc(sizeof(char *) * server_num);
-    weight = (int *)malloc(sizeof(int) * server_num);
+    if (col) {
+        peers->table = ngx_palloc(cf->pool,
+                                  sizeof(ngx_http_upstream_dynamic_hash_slot_t) * col);
+        if (peers->table == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (uhcf->algorithm == NGX_HTTP_UPSTREAM_DYNAMIC_HASH_RENDEZVOUS) {
+        peers->seeds = ngx_palloc(cf->pool, sizeof(uint32_t) * server_num);
+        if (peers->seeds == NULL) {
+            return NGX_ERROR;
+        }
+
+#if (NGX_HTTP_UPSTREAM_DYNAMIC_HASH_X86)
+        __builtin_cpu_init();
+        ngx_http_upstream_dynamic_hash_avx2 = __builtin_cpu_supports("avx2");
+#endif
+    }
+
+    peers->number = server_num;
+    peers->capacity = server_num;
+    peers->table_size = col;
+    peers->algorithm = uhcf->algorithm;
 
     count = 0;
     for (i = 0; i < us->servers->nelts; i++) {
-        if (server[i].backup)
+        if (server[i].backup != backup)
             continue;
 
-        ip = (struct sockaddr_in *)server[i].addrs[0].sockaddr;
-        ip_addr = inet_ntoa(ip->sin_addr);
-        ip_port = (unsigned int)ntohs(ip->sin_port);
+        for (j = 0; j < server[i].naddrs; j++) {
+            peers->peer[count].sockaddr = server[i].addrs[j].sockaddr;
+            peers->peer[count].socklen = server[i].addrs[j].socklen;
+            peers->peer[count].name = server[i].addrs[j].name;
+            peers->peer[count].down = server[i].down;
+            peers->peer[count].weight = server[i].weight;
+            peers->peer[count].max_fails = server[i].max_fails;
+            peers->peer[count].fail_timeout = server[i].fail_timeout;
+            peers->peer[count].ramp = NGX_HTTP_UPSTREAM_DYNAMIC_HASH_RAMP_FULL;
+            ngx_http_upstream_dynamic_hash_seed(&peers->peer[count], col);
+
+#if (NGX_HTTP_UPSTREAM_HASH_CHECK)
+            peers->peer[count].check = ngx_http_upstream_hash_check_add_peer(
+                                           cf, us, &server[i].addrs[j]);
+            if (peers->peer[count].check == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+#endif
+
+            if (peers->seeds) {
+                peers->seeds[count] =
+                    ngx_http_upstream_dynamic_hash_rendezvous_seed(
+                        &peers->peer[count]);
+            }
+
+            count++;
+        }
+    }
+
+    if (col == 0) {
+        for (i = 0; i < server_num; i++) {
+            peers->total_weight += peers->peer[i].weight;
+        }
 
-        addr_name = (char *)malloc(sizeof(char) * 30);
+        peers->weighted = (peers->total_weight != server_num);
 
-        sprintf(addr_name, "%d", ip_port);
-        strcat(addr_name, ip_addr);
-	//fprintf(stderr, "addr name %s\n", addr_name);
-        server_name[count] = addr_name;
-        weight[count] = server[i].weight;
-        //fprintf(stderr, "addr weight %d\n", (int)server[i].weight);
-        count ++;
+        if (peers->weighted
+            && peers->algorithm == NGX_HTTP_UPSTREAM_DYNAMIC_HASH_JUMP)
+        {
+            ngx_log_error(NGX_LOG_WARN, cf->log, 0,
+                          "dynamic_hash algorithm=jump ignores server "
+                          "weights in upstream \"%V\"", &us->host);
+        }
 
+    } else if (ngx_http_upstream_dynamic_hash_build(peers, peers->table)
+               != NGX_OK)
+    {
+        return NGX_ERROR;
     }
 
-    entry = (int*)malloc(sizeof(int) * col);
-    init_peers(server_num, col, weight, server_name, entry);
+    ngx_http_upstream_dynamic_hash_live(peers);
 
-    peers = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_dynamic_hash_peers_t)
-                                  + sizeof(ngx_http_upstream_dynamic_hash_peer_t) * col);
+    *tier = peers;
 
-    for (i=0; i<col; i++) {
-	//ngx_log_stderr(0, "dynamic: %d: name: \"%s\"", i, inet_ntoa(((struct sockaddr_in *)server[entry[i]].addrs[0].sockaddr)->sin_addr));
-	//ngx_log_stderr(0, "dynamic: %d: port: \"%d\"", i, (unsigned int)ntohs(((struct sockaddr_in *)server[entry[i]].addrs[0].sockaddr)->sin_port));
-        peers->peer[i].sockaddr = server[entry[i]].addrs[0].sockaddr;
-        peers->peer[i].socklen = server[entry[i]].addrs[0].socklen;
-        peers->peer[i].name = server[entry[i]].addrs[0].name;
-        peers->peer[i].down = server[entry[i]].down;
-        peers->peer[i].weight = server[entry[i]].weight;
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_upstream_init_dynamic_hash(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_upstream_dynamic_hash_peers_t  *peers, *backup;
+
+    //fprintf(stderr, "dynamic func %s\n", "init");
+    us->peer.init = ngx_http_upstream_init_dynamic_hash_peer;
+
+    if (ngx_http_upstream_dynamic_hash_init_tier(cf, us, 0, &peers) != NGX_OK
+        || ngx_http_upstream_dynamic_hash_init_tier(cf, us, 1, &backup)
+           != NGX_OK)
+    {
+        return NGX_ERROR;
     }
 
+    peers->next = backup;
+
     us->peer.data = peers;
 
-    gettimeofday(&end, NULL);
-    fprintf(stderr, "dynamic init last %ld \n", 1000000*(end.tv_sec-start.tv_sec)+end.tv_usec-start.tv_usec);
+#if (NGX_HTTP_UPSTREAM_HASH_CHECK)
+    (void) ngx_http_upstream_hash_check_set_handler(us,
+               ngx_http_upstream_dynamic_hash_check_handler,
+               ngx_http_conf_upstream_srv_conf(us,
+                                      ngx_http_upstream_dynamic_hash_module));
+#endif
 
     return NGX_OK;
 }
 
+
+/*
+ * Fills "table" from the current backends of "peers".  Removed backends and
+ * those failing their hash_check get no slots; down ones keep theirs and are
+ * skipped at lookup time so that their keys come back to them when they
+ * recover.
+ */
+
 static ngx_int_t
-ngx_http_upstream_init_dynamic_hash_peer(ngx_http_request_t *r,
-                                         ngx_http_upstream_srv_conf_t *us)
+ngx_http_upstream_dynamic_hash_build(ngx_http_upstream_dynamic_hash_peers_t *peers,
+                                     ngx_http_upstream_dynamic_hash_slot_t *table)
 {
-    char                                 name[30];
-    struct sockaddr_in                     *sin;
-    ngx_http_upstream_dynamic_hash_peer_data_t  *iphp;
-    ngx_http_upstream_dynamic_hash_conf_t	 *uhcf;
-    struct timeval start;
+    uint64_t                         *weight;
+    int                              *offset, *skip;
+    int                              *entry;
+    ngx_uint_t                       *map, *quota;
+    ngx_uint_t                        i, row;
+    ngx_int_t                         rc;
+    ngx_http_upstream_dynamic_hash_peer_t  *peer;
 
-    ngx_str_t val;
+    rc = NGX_ERROR;
 
-    gettimeofday(&start, NULL);
+    weight = malloc(sizeof(uint64_t) * peers->number);
+    offset = malloc(sizeof(int) * peers->number);
+    skip = malloc(sizeof(int) * peers->number);
+    map = malloc(sizeof(ngx_uint_t) * peers->number);
+    quota = malloc(sizeof(ngx_uint_t) * peers->number);
+    entry = malloc(sizeof(int) * peers->table_size);
 
+    if (weight == NULL || offset == NULL || skip == NULL || map == NULL
+        || quota == NULL || entry == NULL)
+    {
+        goto failed;
+    }
 
-    uhcf = ngx_http_conf_upstream_srv_conf(us, ngx_http_upstream_dynamic_hash_module);
+    if (ngx_http_upstream_dynamic_hash_quota(peers, quota) != NGX_OK) {
+        goto failed;
+    }
 
-    if (uhcf == NULL) {
-	return NGX_ERROR;
+    peers->total_weight = 0;
+
+    row = 0;
+    for (i = 0; i < peers->number; i++) {
+        peer = &peers->peer[i];
+
+        if (peer->removed || peer->unhealthy) {
+            continue;
+        }
+
+        weight[row] = (uint64_t) peer->weight * peer->ramp;
+        offset[row] = (int) peer->offset;
+        skip[row] = (int) peer->skip;
+        map[row] = i;
+        quota[row] = quota[i];
+        peers->total_weight += peer->weight;
+        row++;
     }
 
-    iphp = ngx_palloc(r->pool, sizeof(ngx_http_upstream_dynamic_hash_peer_data_t));
-    if (iphp == NULL) {
-        return NGX_ERROR;
+    if (row == 0) {
+        goto failed;
     }
 
-    r->upstream->peer.data = iphp;
-    iphp->peers = us->peer.data;
+    peers->weighted = (peers->total_weight != row);
 
-    if (ngx_http_script_run(r, &val, uhcf->lengths->elts, 0, uhcf->values->elts) == NULL) {
-        return NGX_ERROR;
+    if (init_peers(row, peers->table_size, weight, quota, offset, skip, entry)
+        != NGX_OK)
+    {
+        goto failed;
     }
 
-    r->upstream->peer.get = ngx_http_upstream_get_dynamic_hash_peer;
-
-    sin = (struct sockaddr_in *) r->connection->sockaddr;
-    strcat(name, inet_ntoa(sin->sin_addr));
+    for (i = 0; i < peers->table_size; i++) {
+        table[i] = (ngx_http_upstream_dynamic_hash_slot_t) map[entry[i]];
+    }
 
-    iphp->hash = h1((char *)val.data, val.len) % 53;
+    rc = NGX_OK;
 
-    //ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-    //               "dynamic client name %s", name
-    //               );
-    
-    //ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-    //               "dynamic iphp hash %d",
-    //               iphp->hash);
+failed:
 
-    iphp->tries = 0;
-    //iphp->get_rr_peer = ngx_http_upstream_get_round_robin_peer;
+    free(entry);
+    free(quota);
+    free(map);
+    free(skip);
+    free(offset);
+    free(weight);
 
-    return NGX_OK;
+    return rc;
 }
 
 
+/*
+ * Moves the fewest slots needed to bring every backend to its weighted
+ * share, starting from the current table.  Each backend below its share
+ * walks its own permutation and takes the first slots owned by a removed
+ * or over-served backend, so a backend that joins takes its most preferred
+ * slots and the keys of the others stay put.  Besides one counting pass
+ * over the table, the work is proportional to the number of moved slots.
+ */
+
 static ngx_int_t
-ngx_http_upstream_get_dynamic_hash_peer(ngx_peer_connection_t *pc, void *data)
+ngx_http_upstream_dynamic_hash_update(ngx_http_upstream_dynamic_hash_peers_t *peers,
+                                      ngx_http_upstream_dynamic_hash_slot_t *old,
+                                      ngx_http_upstream_dynamic_hash_slot_t *table)
 {
-    ngx_http_upstream_dynamic_hash_peer_data_t  *iphp = data;
-
-    int                    hash;
+    ngx_uint_t                              i, j, s, o, *quota, *count;
     ngx_http_upstream_dynamic_hash_peer_t  *peer;
-    struct timeval start, end;
 
-    gettimeofday(&start, NULL);
+    quota = malloc(sizeof(ngx_uint_t) * peers->number);
+    count = calloc(peers->number, sizeof(ngx_uint_t));
 
-    //fprintf(stderr, "dynamic func %s\n", "get peer");
+    if (quota == NULL || count == NULL) {
+        free(quota);
+        free(count);
+        return NGX_ERROR;
+    }
 
-    pc->cached = 0;
-    pc->connection = NULL;
+    if (ngx_http_upstream_dynamic_hash_quota(peers, quota) != NGX_OK) {
+        free(quota);
+        free(count);
+        return NGX_ERROR;
+    }
 
-    //fprintf(stderr, "dynamic func2 %s\n", "get peer");
-    hash = iphp->hash;
-    //fprintf(stderr, "dynamic func3 %d\n", hash);
+    ngx_memcpy(table, old,
+               sizeof(ngx_http_upstream_dynamic_hash_slot_t) * peers->table_size);
 
-    peer = &iphp->peers->peer[hash];
+    for (s = 0; s < peers->table_size; s++) {
+        count[table[s]]++;
+    }
 
-    //ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0, "dynamic sockaddr: %s", "world");
+    for (i = 0; i < peers->number; i++) {
+        peer = &peers->peer[i];
+        s = peer->offset;
 
-    pc->sockaddr = peer->sockaddr;
-    pc->socklen = peer->socklen;
-    pc->name = &peer->name;
+        for (j = 0; count[i] < quota[i] && j < peers->table_size; j++) {
+            o = table[s];
+
+            if (o != i && count[o] > quota[o]) {
+                table[s] = (ngx_http_upstream_dynamic_hash_slot_t) i;
+                count[o]--;
+                count[i]++;
+            }
 
-    print_sockaddr(pc->log, peer->sockaddr);
+            s += peer->skip;
+            if (s >= peers->table_size) {
+                s -= peers->table_size;
+            }
+        }
+    }
 
-    gettimeofday(&end, NULL);
-    fprintf(stderr, "dynamic get end %ld\n", 1000000*end.tv_sec + end.tv_usec);
-    fprintf(stderr, "dynamic get last %ld\n", 1000000*(end.tv_sec-start.tv_sec) + end.tv_usec - start.tv_usec);
+    free(quota);
+    free(count);
 
     return NGX_OK;
 }
 
-static void print_sockaddr(ngx_log_t *log, struct sockaddr *addr) {
-    //struct sockaddr_in *ip;
 
-    //ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0, "dynamic sockaddr: %s", "world");
-    //ip = (struct sockaddr_in *)addr;
-    //ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0, "dynamic sockaddr: %s", inet_ntoa(ip->sin_addr));
-}
+/*
+ * Splits the table between the live, healthy backends in proportion to
+ * their weights in effect; the remainder goes to the largest fractional
+ * parts.
+ */
 
-static char *
-ngx_http_upstream_dynamic_hash(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+static ngx_int_t
+ngx_http_upstream_dynamic_hash_quota(ngx_http_upstream_dynamic_hash_peers_t *peers,
+                                     ngx_uint_t *quota)
 {
-    ngx_http_upstream_srv_conf_t    *uscf;
-    ngx_http_script_compile_t	    sc;
-    ngx_str_t			    *value;
-    ngx_http_upstream_dynamic_hash_conf_t	*uhcf;
+    uint64_t     *rest, total, weight;
+    ngx_uint_t    i, n, left;
 
-    value = cf->args->elts;
+    total = 0;
 
-    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
-    uhcf = ngx_http_conf_upstream_srv_conf(uscf, ngx_http_upstream_dynamic_hash_module);
+    for (i = 0; i < peers->number; i++) {
+        if (!peers->peer[i].removed && !peers->peer[i].unhealthy) {
+            total += (uint64_t) peers->peer[i].weight * peers->peer[i].ramp;
+        }
+    }
 
-    //fprintf(stderr, "dynamic func1 %s\n", "hash");
+    if (total == 0) {
+        return NGX_ERROR;
+    }
+
+    rest = malloc(sizeof(uint64_t) * peers->number);
+    if (rest == NULL) {
+        return NGX_ERROR;
+    }
 
-    ngx_memzero(&sc, sizeof(ngx_http_script_compile_t));
+    left = peers->table_size;
+
+    for (i = 0; i < peers->number; i++) {
+        if (peers->peer[i].removed || peers->peer[i].unhealthy) {
+            quota[i] = 0;
+            rest[i] = 0;
+            continue;
+        }
 
-    sc.cf = cf;
-    sc.source = &value[1];
-    sc.lengths = &uhcf->lengths;
-    sc.values = &uhcf->values;
-    sc.complete_lengths = 1;
-    sc.complete_values = 1;
+        weight = (uint64_t) peers->peer[i].weight * peers->peer[i].ramp;
 
-    //fprintf(stderr, "dynamic func2 %s\n", "hash");
-    if (ngx_http_script_compile(&sc) != NGX_OK) {
-	return NGX_CONF_ERROR;
+        quota[i] = peers->table_size * weight / total;
+        rest[i] = peers->table_size * weight % total;
+        left -= quota[i];
     }
 
-    //fprintf(stderr, "dynamic func2 %s\n", "hash");
-    
-    uscf->peer.init_upstream = ngx_http_upstream_init_dynamic_hash;
+    /* left is below the number of backends */
 
-    uscf->flags = NGX_HTTP_UPSTREAM_CREATE
-                  |NGX_HTTP_UPSTREAM_MAX_FAILS
-                  |NGX_HTTP_UPSTREAM_FAIL_TIMEOUT
-                  |NGX_HTTP_UPSTREAM_DOWN
-		  |NGX_HTTP_UPSTREAM_WEIGHT;
+    while (left--) {
+        n = 0;
 
-    //fprintf(stderr, "dynamic func3 %s\n", "hash");
+        for (i = 1; i < peers->number; i++) {
+            if (rest[i] > rest[n]) {
+                n = i;
+            }
+        }
 
-    return NGX_CONF_OK;
+        quota[n]++;
+        rest[n] = 0;
+    }
+
+    free(rest);
+
+    return NGX_OK;
 }
 
-static void * ngx_http_upstream_dynamic_hash_create_srv_conf(ngx_conf_t *cf)
+
+/* offset and skip define the permutation walked by init_peers() and update() */
+
+static void
+ngx_http_upstream_dynamic_hash_seed(ngx_http_upstream_dynamic_hash_peer_t *peer,
+                                    ngx_uint_t size)
 {
-    ngx_http_upstream_dynamic_hash_conf_t *conf;
-  
-    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_dynamic_hash_conf_t));
+    char  name[NGX_SOCKADDR_STRLEN + 1];
 
-    if (conf == NULL) {
-	return NULL;
+    if (size == 0) {
+        return;
     }
 
-    return conf;
+    ngx_http_upstream_dynamic_hash_identity(peer, name);
+
+    peer->offset = (h1(name, strlen(name)) & 0x7fffffff) % size;
+    peer->skip = (h2(name, strlen(name)) & 0x7fffffff) % (size - 1) + 1;
 }
 
-static int h1(char* str, int len) {
-    int b    = 378551;
-    int a    = 63689;
-    int hash = 0;
-    int i    = 0;
 
-    for(i = 0; i < len; str++, i++)
-    {
-        hash = hash * a + (*str);
-        a    = a * b;
-    }
+/*
+ * The permutation of a backend is seeded by its address: "<port><ipv4>"
+ * for IPv4, as it always was, "[<ipv6>]:<port>" and "unix:<path>" for the
+ * other families.  The text comes from the sockaddr, so it does not depend
+ * on how the server was spelled in the configuration or the admin request.
+ */
 
-    return hash>0?hash:-hash;
-}
+static void
+ngx_http_upstream_dynamic_hash_identity(ngx_http_upstream_dynamic_hash_peer_t *peer,
+                                        char *name)
+{
+    u_char              *p;
+    struct sockaddr_in  *ip;
 
-static int h2(char* str, int len) {
-    int hash = 1315423911;
-    int i    = 0;
+    if (peer->sockaddr->sa_family == AF_INET) {
+        ip = (struct sockaddr_in *) peer->sockaddr;
 
-    for(i = 0; i < len; str++, i++)
-    {
-        hash ^= ((hash << 5) + (*str) + (hash >> 2));
+        p = ngx_sprintf((u_char *) name, "%ui", (ngx_uint_t) ntohs(ip->sin_port));
+        p += ngx_inet_ntop(AF_INET, &ip->sin_addr, p, NGX_INET_ADDRSTRLEN);
+        *p = '\0';
+        return;
     }
 
-    return hash>0?hash:-hash;
+    p = (u_char *) name;
+    p += ngx_sock_ntop(peer->sockaddr, peer->socklen, p, NGX_SOCKADDR_STRLEN, 1);
+    *p = '\0';
 }
 
-static void getPermutation(int** permutation, int row, int col, char** name) {
-    int offset;
-    int skip;
-    int i,j;
 
-    for (i=0; i<row; i++) {
-        offset = h1(name[i], strlen(name[i])) % col;
-        skip = h2(name[i], strlen(name[i])) % (col-1) + 1;
-        for (j=0; j<col; j++) {
-            permutation[i][j] = (offset + j*skip) % col;
+/*
+ * Bounded loads share the requests in flight among the backends that can
+ * take them right now, and a walk may stop once it has met all of them.
+ */
+
+static void
+ngx_http_upstream_dynamic_hash_live(ngx_http_upstream_dynamic_hash_peers_t *peers)
+{
+    ngx_uint_t                              i;
+    ngx_http_upstream_dynamic_hash_peer_t  *peer;
+
+    peers->live = 0;
+    peers->live_weight = 0;
+
+    for (i = 0; i < peers->number; i++) {
+        peer = &peers->peer[i];
+
+        if (peer->removed || peer->down || peer->unhealthy) {
+            continue;
         }
+
+        peers->live++;
+        peers->live_weight += (uint64_t) peer->weight * peer->ramp;
     }
 }
 
-static void init_peers(int row, int col, int* weight, char** name, int* entry) {
 
-    int i;
-    int* next;
-    int* sum;
-    int** permutation;
-    int c;
-    int n=0;
+/*
+ * Updates the table into the spare buffer and publishes it.  Workers read
+ * peers->table without locking.  The spare buffer is the table that was
+ * current two publications ago, and a worker may still be walking it while
+ * it is rewritten; every slot always holds a valid index, but the walk can
+ * see a mix of old and new slots.  Such walks are detected by the
+ * generation bumped below and repeated, see walk_stable().  The caller
+ * holds the zone mutex.  Returns the number of slots whose backend changed.
+ */
 
-    next = (int*)malloc(sizeof(int) * row);
-    sum = (int*)malloc(sizeof(int) * row);
-    permutation = (int **)malloc(sizeof(int*) * row);
-    for (i=0; i<row; i++) {
-        permutation[i] = (int*)malloc(sizeof(int) * col);
+ngx_int_t
+ngx_http_upstream_dynamic_hash_publish(ngx_http_upstream_dynamic_hash_peers_t *peers)
+{
+    ngx_uint_t                               i, n, healthy, ramping, moved;
+    ngx_http_upstream_dynamic_hash_slot_t   *table, *old;
+
+    if (peers->shpool == NULL) {
+        return NGX_ERROR;
     }
 
-    for (i=0; i<row; i++) {
-        next[i] = 0;
-        sum[i] = 0;
+    /* rendezvous and bounded loads use the live weights */
+
+    peers->total_weight = 0;
+    n = 0;
+    healthy = 0;
+    ramping = 0;
+
+    for (i = 0; i < peers->number; i++) {
+        if (!peers->peer[i].removed) {
+            peers->total_weight += peers->peer[i].weight;
+            n++;
+
+            if (peers->peer[i].ramp != NGX_HTTP_UPSTREAM_DYNAMIC_HASH_RAMP_FULL) {
+                ramping = 1;
+            }
+
+            if (!peers->peer[i].unhealthy) {
+                healthy++;
+            }
+        }
     }
 
-    for (i=0; i<col; i++) {
-        entry[i] = -1;
+    /* with no healthy backend left, all of them keep their share */
+
+    if (healthy == 0) {
+        for (i = 0; i < peers->number; i++) {
+            peers->peer[i].unhealthy = 0;
+        }
     }
 
-    getPermutation(permutation, row, col, name);
+    peers->weighted = (peers->total_weight != n) || ramping;
 
-    while (1) {
-        for (i=0; i<row; i++) {
-            sum[i] += weight[i];
-            while (sum[i] >= 1) {
-                sum[i] -= 1;
-                c = permutation[i][next[i]];
-                while (entry[c] >= 0) {
-                    next[i] = next[i]+1;
-                    c = permutation[i][next[i]];
-                }
-                entry[c] = i;
-                next[i] = next[i]+1;
-                n = n+1;
-                if (n == col) {
-                    return;
-                }
-            }
+    ngx_http_upstream_dynamic_hash_live(peers);
+
+    if (peers->table == NULL) {
+        /* nothing to rebuild */
+
+        peers->rebuild = 0;
+
+        ngx_memory_barrier();
+
+        (void) ngx_atomic_fetch_add(&peers->generation, 1);
+
+        return 0;
+    }
+
+    old = peers->table;
+    table = (old == peers->tables[0]) ? peers->tables[1] : peers->tables[0];
+
+    if (peers->rebuild) {
+        if (ngx_http_upstream_dynamic_hash_build(peers, table) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        peers->rebuild = 0;
+
+    } else {
+        if (ngx_http_upstream_dynamic_hash_update(peers, old, table) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    moved = 0;
+
+    for (i = 0; i < peers->table_size; i++) {
+        if (table[i] != old[i]) {
+            moved++;
         }
     }
+
+    ngx_memory_barrier();
+
+    peers->table = table;
+
+    (void) ngx_atomic_fetch_add(&peers->generation, 1);
+
+    return moved;
+}
+
+
+/*
+ * Backend slots are never freed while the zone lives: a request may still
+ * use the sockaddr of a backend that was just removed.  New backends take
+ * a fresh slot and only reuse a removed one when the zone is full.
+ * The caller holds the zone mutex.
+ */
+
+ngx_int_t
+ngx_http_upstream_dynamic_hash_add_peer(ngx_http_upstream_dynamic_hash_peers_t *peers,
+                                        ngx_addr_t *addr, ngx_int_t weight)
+{
+    ngx_uint_t                              i;
+    ngx_http_upstream_dynamic_hash_peer_t  *peer;
+
+    if (peers->shpool == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < peers->number; i++) {
+        peer = &peers->peer[i];
+
+        if (!peer->removed
+            && ngx_cmp_sockaddr(peer->sockaddr, peer->socklen,
+                                addr->sockaddr, addr->socklen, 1)
+               == NGX_OK)
+        {
+            return NGX_DECLINED;
+        }
+    }
+
+    if (peers->number < peers->capacity) {
+        i = peers->number;
+        peer = &peers->peer[i];
+
+        peer->sockaddr = ngx_slab_alloc_locked(peers->shpool, NGX_SOCKADDRLEN);
+        peer->name.data = ngx_slab_alloc_locked(peers->shpool,
+                                                NGX_SOCKADDR_STRLEN);
+
+        if (peer->sockaddr == NULL || peer->name.data == NULL) {
+            return NGX_ERROR;
+        }
+
+    } else {
+        for (i = 0; i < peers->number; i++) {
+            if (peers->peer[i].removed) {
+                break;
+            }
+        }
+
+        if (i == peers->number) {
+            return NGX_BUSY;
+        }
+
+        /* the old table still maps the reused index to its former owner */
+
+        peers->rebuild = 1;
+
+        peer = &peers->peer[i];
+    }
+
+    ngx_memcpy(peer->sockaddr, addr->sockaddr, addr->socklen);
+    peer->socklen = addr->socklen;
+
+    peer->name.len = ngx_min(addr->name.len, NGX_SOCKADDR_STRLEN);
+    ngx_memcpy(peer->name.data, addr->name.data, peer->name.len);
+
+    peer->weight = weight;
+    peer->down = 0;
+    peer->fails = 0;
+    peer->until = 0;
+    peer->max_fails = 1;
+    peer->fail_timeout = 10;
+    peer->unhealthy = 0;
+    peer->ramp = NGX_HTTP_UPSTREAM_DYNAMIC_HASH_RAMP_FULL;
+#if (NGX_HTTP_UPSTREAM_HASH_CHECK)
+    peer->check = NGX_DECLINED;     /* only configured servers are checked */
+#endif
+
+    ngx_http_upstream_dynamic_hash_ramp_up(peers, peer);
+
+    ngx_http_upstream_dynamic_hash_seed(peer, peers->table_size);
+
+    if (peers->seeds) {
+        peers->seeds[i] = ngx_http_upstream_dynamic_hash_rendezvous_seed(peer);
+    }
+
+    ngx_memory_barrier();
+
+    peer->removed = 0;
+
+    if (i == peers->number) {
+        peers->number++;
+    }
+
+    return i;
+}
+
+
+ngx_int_t
+ngx_http_upstream_dynamic_hash_remove_peer(ngx_http_upstream_dynamic_hash_peers_t *peers,
+                                           ngx_uint_t n)
+{
+    ngx_uint_t  i, live;
+
+    if (peers->shpool == NULL || n >= peers->number || peers->peer[n].removed) {
+        return NGX_ERROR;
+    }
+
+    live = 0;
+
+    for (i = 0; i < peers->number; i++) {
+        if (!peers->peer[i].removed) {
+            live++;
+        }
+    }
+
+    if (live == 1) {
+        return NGX_DECLINED;
+    }
+
+    peers->peer[n].removed = 1;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_dynamic_hash_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    size_t                                   len, size;
+    ngx_uint_t                               i, capacity;
+    ngx_slab_pool_t                         *shpool;
+    ngx_http_upstream_dynamic_hash_peer_t   *peer, *src;
+    ngx_http_upstream_dynamic_hash_conf_t   *uhcf;
+    ngx_http_upstream_dynamic_hash_peers_t  *peers, *speers;
+
+    uhcf = shm_zone->data;
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    peers = uhcf->upstream->peer.data;
+
+    if (peers == NULL) {
+        return NGX_OK;
+    }
+
+    len = sizeof(" in dynamic_hash zone \"\"") + shm_zone->shm.name.len;
+
+    shpool->log_ctx = ngx_slab_alloc(shpool, len);
+    if (shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(shpool->log_ctx, " in dynamic_hash zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    /*
+     * half of the zone is left to the slab allocator overhead and
+     * to later allocations, the rest bounds the number of backends
+     */
+
+    size = 2 * sizeof(ngx_http_upstream_dynamic_hash_slot_t) * peers->table_size;
+
+    if (size >= shm_zone->shm.size / 2) {
+        ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                      "dynamic_hash zone \"%V\" is too small for "
+                      "table_size=%ui", &shm_zone->shm.name, peers->table_size);
+        return NGX_ERROR;
+    }
+
+    capacity = (shm_zone->shm.size / 2 - size)
+               / (sizeof(ngx_http_upstream_dynamic_hash_peer_t)
+                  + NGX_SOCKADDRLEN + NGX_SOCKADDR_STRLEN + sizeof(uint32_t));
+
+    capacity = ngx_min(capacity, NGX_HTTP_UPSTREAM_DYNAMIC_HASH_MAX_PEERS);
+
+    if (capacity < peers->number) {
+        ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                      "dynamic_hash zone \"%V\" is too small for %ui servers",
+                      &shm_zone->shm.name, peers->number);
+        return NGX_ERROR;
+    }
+
+    speers = ngx_slab_calloc(shpool,
+                             sizeof(ngx_http_upstream_dynamic_hash_peers_t)
+                             + sizeof(ngx_http_upstream_dynamic_hash_peer_t)
+                               * capacity);
+    if (speers == NULL) {
+        return NGX_ERROR;
+    }
+
+    size = sizeof(ngx_http_upstream_dynamic_hash_slot_t) * peers->table_size;
+
+    if (size) {
+        speers->tables[0] = ngx_slab_alloc(shpool, size);
+        speers->tables[1] = ngx_slab_alloc(shpool, size);
+
+        if (speers->tables[0] == NULL || speers->tables[1] == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(speers->tables[0], peers->table, size);
+        ngx_memcpy(speers->tables[1], peers->table, size);
+
+        speers->table = speers->tables[0];
+    }
+
+    if (peers->seeds) {
+        speers->seeds = ngx_slab_alloc(shpool, sizeof(uint32_t) * capacity);
+        if (speers->seeds == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(speers->seeds, peers->seeds,
+                   sizeof(uint32_t) * peers->number);
+    }
+
+    speers->number = peers->number;
+    speers->capacity = capacity;
+    speers->total_weight = peers->total_weight;
+    speers->live = peers->live;
+    speers->live_weight = peers->live_weight;
+    speers->table_size = peers->table_size;
+    speers->algorithm = peers->algorithm;
+    speers->next = peers->next;
+    speers->bounded_load = uhcf->bounded_load;
+    speers->slow_start = uhcf->slow_start;
+    speers->weighted = peers->weighted;
+    speers->shpool = shpool;
+
+    for (i = 0; i < peers->number; i++) {
+        src = &peers->peer[i];
+        peer = &speers->peer[i];
+
+        *peer = *src;
+
+        peer->sockaddr = ngx_slab_alloc(shpool, NGX_SOCKADDRLEN);
+        peer->name.data = ngx_slab_alloc(shpool, NGX_SOCKADDR_STRLEN);
+
+        if (peer->sockaddr == NULL || peer->name.data == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(peer->sockaddr, src->sockaddr, src->socklen);
+
+        peer->name.len = ngx_min(src->name.len, NGX_SOCKADDR_STRLEN);
+        ngx_memcpy(peer->name.data, src->name.data, peer->name.len);
+    }
+
+    shpool->data = speers;
+    uhcf->upstream->peer.data = speers;
+
+    ngx_log_error(NGX_LOG_NOTICE, shm_zone->shm.log, 0,
+                  "dynamic_hash zone \"%V\" holds up to %ui servers",
+                  &shm_zone->shm.name, capacity);
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_upstream_init_dynamic_hash_peer(ngx_http_request_t *r,
+                                         ngx_http_upstream_srv_conf_t *us)
+{
+    size_t                                       n;
+    uint64_t                                     start, key;
+    ngx_uint_t                                   scores;
+    ngx_http_upstream_dynamic_hash_peer_data_t  *iphp;
+    ngx_http_upstream_dynamic_hash_peers_t      *peers;
+    ngx_http_upstream_dynamic_hash_conf_t	 *uhcf;
+
+    ngx_str_t val;
+
+    uhcf = ngx_http_conf_upstream_srv_conf(us, ngx_http_upstream_dynamic_hash_module);
+
+    if (uhcf == NULL) {
+	return NGX_ERROR;
+    }
+
+    peers = us->peer.data;
+
+    n = sizeof(uintptr_t) * ngx_bitvector_index(peers->capacity);
+    scores = peers->capacity;
+
+    if (peers->next) {
+        n += sizeof(uintptr_t) * (ngx_bitvector_index(peers->next->number) + 1);
+        scores = ngx_max(scores, peers->next->number);
+    }
+
+    iphp = ngx_pcalloc(r->pool,
+                       sizeof(ngx_http_upstream_dynamic_hash_peer_data_t) + n);
+    if (iphp == NULL) {
+        return NGX_ERROR;
+    }
+
+    r->upstream->peer.data = iphp;
+    iphp->peers = peers;
+    iphp->stats = uhcf->worker_stats;
+
+    start = iphp->stats ? ngx_http_upstream_dynamic_hash_clock() : 0;
+
+    if (uhcf->per_connection) {
+        if (ngx_http_upstream_dynamic_hash_conn_key(r, uhcf, &key) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+    } else {
+        if (ngx_http_upstream_hash_key_eval(r, &uhcf->key, &val) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        key = ngx_http_upstream_dynamic_hash_key(uhcf, val.data, val.len);
+    }
+
+    r->upstream->peer.get = ngx_http_upstream_get_dynamic_hash_peer;
+    r->upstream->peer.free = ngx_http_upstream_free_dynamic_hash_peer;
+    r->upstream->peer.tries = peers->number
+                              + (peers->next ? peers->next->number : 0);
+#if (NGX_HTTP_SSL)
+    r->upstream->peer.set_session =
+                               ngx_http_upstream_set_dynamic_hash_peer_session;
+    r->upstream->peer.save_session =
+                               ngx_http_upstream_save_dynamic_hash_peer_session;
+    iphp->ssl_sessions = uhcf->ssl_sessions;
+#endif
+
+    iphp->key = key;
+    iphp->hash = ngx_http_upstream_dynamic_hash_position(peers, key);
+
+    if (peers->seeds) {
+        iphp->scores = ngx_palloc(r->pool, sizeof(uint32_t) * scores);
+        if (iphp->scores == NULL) {
+            return NGX_ERROR;
+        }
+
+    } else {
+        iphp->seen = ngx_palloc(r->pool, sizeof(uintptr_t)
+                                         * (ngx_bitvector_index(scores) + 1));
+        if (iphp->seen == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (iphp->stats) {
+        ngx_http_upstream_dynamic_hash_record(
+            iphp->stats->hist[NGX_HTTP_UPSTREAM_DYNAMIC_HASH_KEY], start);
+    }
+
+    //ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+    //               "dynamic iphp hash %d",
+    //               iphp->hash);
+
+    //iphp->get_rr_peer = ngx_http_upstream_get_round_robin_peer;
+
+    return NGX_OK;
+}
+
+
+/*
+ * With "per_connection" the key is declared to depend on the client
+ * connection only ($ssl_server_name, $remote_addr without realip, ...): it
+ * is evaluated and hashed by the first request, later requests on the same
+ * keepalive or HTTP/2 connection reuse the hash.
+ */
+
+static ngx_int_t
+ngx_http_upstream_dynamic_hash_conn_key(ngx_http_request_t *r,
+    ngx_http_upstream_dynamic_hash_conf_t *uhcf, uint64_t *key)
+{
+    ngx_str_t                               val;
+    ngx_connection_t                       *c;
+    ngx_pool_cleanup_t                     *cln;
+    ngx_http_upstream_dynamic_hash_memo_t  *memo;
+
+    c = r->connection;
+
+#if (NGX_HTTP_V2)
+    if (r->stream) {
+        c = r->stream->connection->connection;
+    }
+#endif
+
+    for (cln = c->pool->cleanup; cln; cln = cln->next) {
+
+        if (cln->handler != ngx_http_upstream_dynamic_hash_memo_cleanup) {
+            continue;
+        }
+
+        memo = cln->data;
+
+        if (memo->conf == uhcf) {
+            *key = memo->key;
+            return NGX_OK;
+        }
+    }
+
+    if (ngx_http_upstream_hash_key_eval(r, &uhcf->key, &val) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    *key = ngx_http_upstream_dynamic_hash_key(uhcf, val.data, val.len);
+
+    cln = ngx_pool_cleanup_add(c->pool,
+                               sizeof(ngx_http_upstream_dynamic_hash_memo_t));
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_http_upstream_dynamic_hash_memo_cleanup;
+
+    memo = cln->data;
+    memo->conf = uhcf;
+    memo->key = *key;
+
+    return NGX_OK;
+}
+
+
+/* only marks the memo entries in the cleanup list */
+
+static void
+ngx_http_upstream_dynamic_hash_memo_cleanup(void *data)
+{
+}
+
+
+/* where the lookup of a key starts in a tier */
+
+static ngx_uint_t
+ngx_http_upstream_dynamic_hash_position(
+    ngx_http_upstream_dynamic_hash_peers_t *peers, uint64_t key)
+{
+    switch (peers->algorithm) {
+
+    case NGX_HTTP_UPSTREAM_DYNAMIC_HASH_JUMP:
+        return ngx_http_upstream_dynamic_hash_jump(key, peers->number);
+
+    case NGX_HTTP_UPSTREAM_DYNAMIC_HASH_RENDEZVOUS:
+        return (uint32_t) (key >> 32) ^ (uint32_t) key;
+
+    default: /* NGX_HTTP_UPSTREAM_DYNAMIC_HASH_MAGLEV */
+        return ngx_http_upstream_dynamic_hash_reduce(key, peers->table_size);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_upstream_get_dynamic_hash_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_dynamic_hash_peer_data_t  *iphp = data;
+
+    time_t                 now;
+    ngx_int_t              rc;
+    ngx_uint_t             n;
+    uintptr_t             *tried;
+    ngx_http_upstream_dynamic_hash_peer_t  *peer;
+    ngx_http_upstream_dynamic_hash_peers_t *peers;
+    uint64_t               start;
+
+    start = iphp->stats ? ngx_http_upstream_dynamic_hash_clock() : 0;
+
+    //fprintf(stderr, "dynamic func %s\n", "get peer");
+
+    pc->cached = 0;
+    pc->connection = NULL;
+
+    //fprintf(stderr, "dynamic func2 %s\n", "get peer");
+    now = ngx_time();
+
+    if (iphp->backup) {
+        peers = iphp->peers->next;
+        tried = ngx_http_upstream_dynamic_hash_backup_tried(iphp);
+
+    } else {
+        peers = iphp->peers;
+        tried = iphp->tried;
+    }
+
+    rc = ngx_http_upstream_dynamic_hash_walk_stable(iphp, peers, tried, now);
+
+    /* the backup tier starts over from the key's own position in it */
+
+    if (rc == NGX_BUSY && !iphp->backup && iphp->peers->next) {
+        iphp->backup = 1;
+
+        peers = iphp->peers->next;
+        tried = ngx_http_upstream_dynamic_hash_backup_tried(iphp);
+
+        iphp->hash = ngx_http_upstream_dynamic_hash_position(peers, iphp->key);
+
+        rc = ngx_http_upstream_dynamic_hash_walk_stable(iphp, peers, tried, now);
+    }
+
+    if (iphp->stats) {
+        ngx_http_upstream_dynamic_hash_record(
+            iphp->stats->hist[NGX_HTTP_UPSTREAM_DYNAMIC_HASH_SELECT], start);
+    }
+
+    if (rc == NGX_BUSY) {
+        return NGX_BUSY;
+    }
+
+    n = rc;
+    peer = &peers->peer[n];
+
+    iphp->current = n;
+    iphp->tier = peers;
+    tried[ngx_bitvector_index(n)] |= ngx_bitvector_bit(n);
+
+    if (peers->bounded_load) {
+        (void) ngx_atomic_fetch_add(&peer->conns, 1);
+        (void) ngx_atomic_fetch_add(&peers->conns, 1);
+        iphp->counted = 1;
+    }
+
+    //ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0, "dynamic sockaddr: %s", "world");
+
+    pc->sockaddr = peer->sockaddr;
+    pc->socklen = peer->socklen;
+    pc->name = &peer->name;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "dynamic get peer %ui \"%V\"%s", n, &peer->name,
+                   iphp->backup ? " backup" : "");
+
+    return NGX_OK;
+}
+
+
+/*
+ * A seqlock read of a tier in a zone: the walk only counts if no
+ * publication happened while it ran, since the buffer it read may have
+ * been rewritten as the spare table meanwhile.  Otherwise it starts over
+ * on the table just published.  Publications are rare and a walk is short,
+ * so retries are too.
+ */
+
+static ngx_int_t
+ngx_http_upstream_dynamic_hash_walk_stable(
+    ngx_http_upstream_dynamic_hash_peer_data_t *iphp,
+    ngx_http_upstream_dynamic_hash_peers_t *peers, uintptr_t *tried,
+    time_t now)
+{
+    ngx_int_t           rc;
+    ngx_uint_t          hash;
+    ngx_atomic_uint_t   generation;
+
+    if (peers->shpool == NULL) {
+        return ngx_http_upstream_dynamic_hash_walk(iphp, peers, tried, now);
+    }
+
+    hash = iphp->hash;
+
+    for ( ;; ) {
+        generation = peers->generation;
+
+        ngx_memory_barrier();
+
+        rc = ngx_http_upstream_dynamic_hash_walk(iphp, peers, tried, now);
+
+        ngx_memory_barrier();
+
+        if (peers->generation == generation) {
+            return rc;
+        }
+
+        iphp->hash = hash;
+    }
+}
+
+
+/*
+ * Returns the index of the next candidate of a tier for the key, or
+ * NGX_BUSY when the tier has none left.
+ */
+
+static ngx_int_t
+ngx_http_upstream_dynamic_hash_walk(
+    ngx_http_upstream_dynamic_hash_peer_data_t *iphp,
+    ngx_http_upstream_dynamic_hash_peers_t *peers, uintptr_t *tried,
+    time_t now)
+{
+    ngx_uint_t                              hash, n, steps, size, spill, seen;
+    ngx_http_upstream_dynamic_hash_slot_t  *table;
+    ngx_http_upstream_dynamic_hash_peer_t  *peer;
+
+    if (peers->seeds) {
+        return ngx_http_upstream_get_rendezvous_peer(iphp, peers, tried, now);
+    }
+
+    table = peers->table;
+    hash = iphp->hash;
+
+    /* without a table the walk goes over the peer indices themselves */
+
+    size = table ? peers->table_size : peers->number;
+    spill = size;
+    seen = 0;
+
+    ngx_memzero(iphp->seen,
+                sizeof(uintptr_t) * (ngx_bitvector_index(peers->number) + 1));
+
+    /*
+     * The first try uses the key's own slot.  Retries walk the following
+     * slots of the table: the sequence only depends on the key, so a
+     * failed backend's keys always fail over to the same neighbours and
+     * keep their cache locality there.  With bounded loads a backend
+     * above its share of the requests in flight is passed over the same
+     * way; if all of them are, the first one is used anyway.  The walk
+     * ends as soon as every live backend has been met, instead of going
+     * over the rest of the table.
+     */
+
+    for (steps = 0; /* void */ ; steps++) {
+
+        if (steps == size || seen == peers->live) {
+
+            if (spill == size) {
+                return NGX_BUSY;
+            }
+
+            hash = spill;
+            n = table ? table[hash] : hash;
+            break;
+        }
+
+        n = table ? table[hash] : hash;
+        peer = &peers->peer[n];
+
+        if (!peer->down && !peer->removed && !peer->unhealthy
+            && !(iphp->seen[ngx_bitvector_index(n)] & ngx_bitvector_bit(n)))
+        {
+            iphp->seen[ngx_bitvector_index(n)] |= ngx_bitvector_bit(n);
+            seen++;
+        }
+
+        if (!(tried[ngx_bitvector_index(n)] & ngx_bitvector_bit(n))
+            && !peer->down && !peer->removed
+            && !ngx_http_upstream_dynamic_hash_check_down(peer))
+        {
+            if (!ngx_http_upstream_dynamic_hash_failed(peer)) {
+
+                if (!peers->bounded_load
+                    || !ngx_http_upstream_dynamic_hash_overloaded(peers, peer))
+                {
+                    break;
+                }
+
+                if (spill == size) {
+                    spill = hash;
+                }
+
+            } else if (ngx_http_upstream_dynamic_hash_probe(peer, now)) {
+                break;
+            }
+        }
+
+        if (++hash == size) {
+            hash = 0;
+        }
+    }
+
+    iphp->hash = hash;
+
+    return n;
+}
+
+static void
+ngx_http_upstream_free_dynamic_hash_peer(ngx_peer_connection_t *pc, void *data,
+                                         ngx_uint_t state)
+{
+    ngx_http_upstream_dynamic_hash_peer_data_t  *iphp = data;
+
+    time_t                                  now;
+    ngx_atomic_uint_t                       fails;
+    ngx_http_upstream_dynamic_hash_peer_t  *peer;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "dynamic free peer %ui %ui", iphp->current, state);
+
+    if (iphp->tier == NULL) {
+        /* no peer was selected */
+        pc->tries = 0;
+        return;
+    }
+
+    peer = &iphp->tier->peer[iphp->current];
+
+    if (iphp->counted) {
+        (void) ngx_atomic_fetch_add(&peer->conns, -1);
+        (void) ngx_atomic_fetch_add(&iphp->tier->conns, -1);
+        iphp->counted = 0;
+    }
+
+    if (state & NGX_PEER_FAILED) {
+        now = ngx_time();
+
+        fails = ngx_atomic_fetch_add(&peer->fails, 1) + 1;
+
+        if (peer->max_fails && fails >= peer->max_fails) {
+            peer->until = now + peer->fail_timeout;
+
+            if (fails == peer->max_fails) {
+                ngx_log_error(NGX_LOG_WARN, pc->log, 0,
+                              "dynamic_hash: upstream server temporarily "
+                              "disabled");
+            }
+        }
+
+    } else if (peer->fails) {
+        peer->fails = 0;
+        peer->until = 0;
+    }
+
+    if (pc->tries) {
+        pc->tries--;
+    }
+}
+
+
+#if (NGX_HTTP_SSL)
+
+/*
+ * Sessions are kept per worker and per peer index.  A reused index may
+ * still hold the session of the server it had before; resuming it then
+ * simply fails and a full handshake is done.
+ */
+
+static ngx_int_t
+ngx_http_upstream_set_dynamic_hash_peer_session(ngx_peer_connection_t *pc,
+                                                void *data)
+{
+    ngx_http_upstream_dynamic_hash_peer_data_t  *iphp = data;
+
+    ngx_int_t            rc;
+    ngx_ssl_session_t   *ssl_session;
+
+    if (iphp->ssl_sessions == NULL || iphp->tier != iphp->peers) {
+        return NGX_OK;
+    }
+
+    ssl_session = iphp->ssl_sessions[iphp->current];
+
+    rc = ngx_ssl_set_session(pc->connection, ssl_session);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "set session: %p:%d",
+                   ssl_session, ssl_session ? ssl_session->references : 0);
+
+    return rc;
+}
+
+
+static void
+ngx_http_upstream_save_dynamic_hash_peer_session(ngx_peer_connection_t *pc,
+                                                 void *data)
+{
+    ngx_http_upstream_dynamic_hash_peer_data_t  *iphp = data;
+
+    ngx_ssl_session_t   *old_ssl_session, *ssl_session;
+
+    if (iphp->ssl_sessions == NULL || iphp->tier != iphp->peers) {
+        return;
+    }
+
+    ssl_session = ngx_ssl_get_session(pc->connection);
+
+    if (ssl_session == NULL) {
+        return;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "save session: %p:%d", ssl_session, ssl_session->references);
+
+    old_ssl_session = iphp->ssl_sessions[iphp->current];
+    iphp->ssl_sessions[iphp->current] = ssl_session;
+
+    if (old_ssl_session) {
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "old session: %p:%d",
+                       old_ssl_session, old_ssl_session->references);
+
+        ngx_ssl_free_session(old_ssl_session);
+    }
+}
+
+#endif
+
+static char *
+ngx_http_upstream_dynamic_hash(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ssize_t                         size;
+    ngx_int_t                       n, rc;
+    ngx_uint_t                      i, hash_key;
+    ngx_str_t                       name, s;
+    ngx_http_upstream_srv_conf_t    *uscf;
+    ngx_str_t			    *value;
+    ngx_http_upstream_dynamic_hash_conf_t	*uhcf;
+
+    value = cf->args->elts;
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+    uhcf = ngx_http_conf_upstream_srv_conf(uscf, ngx_http_upstream_dynamic_hash_module);
+
+    //fprintf(stderr, "dynamic func1 %s\n", "hash");
+
+    if (ngx_http_upstream_hash_key_compile(cf, &value[1], &uhcf->key)
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    //fprintf(stderr, "dynamic func2 %s\n", "hash");
+
+    hash_key = 0;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "table_size=", 11) == 0) {
+
+            n = ngx_atoi(&value[i].data[11], value[i].len - 11);
+
+            if (n == NGX_ERROR
+                || n > NGX_HTTP_UPSTREAM_DYNAMIC_HASH_MAX_SIZE
+                || !ngx_http_upstream_dynamic_hash_is_prime(n))
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "\"table_size\" must be a prime number "
+                                   "not larger than %d in \"%V\"",
+                                   NGX_HTTP_UPSTREAM_DYNAMIC_HASH_MAX_SIZE,
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            uhcf->table_size = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+
+            name.data = value[i].data + 5;
+            name.len = value[i].len - 5;
+
+            s.data = ngx_strlchr(name.data, name.data + name.len, ':');
+
+            if (s.data == NULL) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid zone \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            name.len = s.data - name.data;
+            s.data++;
+            s.len = value[i].data + value[i].len - s.data;
+
+            size = ngx_parse_size(&s);
+
+            if (size == NGX_ERROR || size < (ssize_t) (8 * ngx_pagesize)) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            uhcf->shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                            &ngx_http_upstream_dynamic_hash_module);
+            if (uhcf->shm_zone == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            if (uhcf->shm_zone->data) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "zone \"%V\" is already used", &name);
+                return NGX_CONF_ERROR;
+            }
+
+            /* the table is rebuilt from the configuration on every reload */
+
+            uhcf->shm_zone->init = ngx_http_upstream_dynamic_hash_init_zone;
+            uhcf->shm_zone->data = uhcf;
+            uhcf->shm_zone->noreuse = 1;
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "algorithm=maglev") == 0) {
+            uhcf->algorithm = NGX_HTTP_UPSTREAM_DYNAMIC_HASH_MAGLEV;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "algorithm=jump") == 0) {
+            uhcf->algorithm = NGX_HTTP_UPSTREAM_DYNAMIC_HASH_JUMP;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "algorithm=rendezvous") == 0) {
+            uhcf->algorithm = NGX_HTTP_UPSTREAM_DYNAMIC_HASH_RENDEZVOUS;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "bounded_load=", 13) == 0) {
+
+            n = ngx_atofp(&value[i].data[13], value[i].len - 13, 2);
+
+            if (n == NGX_ERROR || n == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid \"bounded_load\" in \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            uhcf->bounded_load = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "slow_start=", 11) == 0) {
+
+            s.len = value[i].len - 11;
+            s.data = &value[i].data[11];
+
+            uhcf->slow_start = ngx_parse_time(&s, 0);
+
+            if (uhcf->slow_start == (ngx_msec_t) NGX_ERROR
+                || uhcf->slow_start == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid \"slow_start\" in \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "per_connection") == 0) {
+            uhcf->per_connection = 1;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "stats") == 0) {
+            uhcf->stats = 1;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "hash=legacy") == 0) {
+            uhcf->hash = NGX_HTTP_UPSTREAM_DYNAMIC_HASH_LEGACY;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "hash=xxh64") == 0) {
+            uhcf->hash = NGX_HTTP_UPSTREAM_DYNAMIC_HASH_XXH64;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "hash=siphash") == 0) {
+            uhcf->hash = NGX_HTTP_UPSTREAM_DYNAMIC_HASH_SIPHASH;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "hash_key=", 9) == 0) {
+
+            if (value[i].len != 9 + 32) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "\"hash_key\" must be 32 hex digits");
+                return NGX_CONF_ERROR;
+            }
+
+            for (n = 0; n < 16; n++) {
+                rc = ngx_hextoi(&value[i].data[9 + 2 * n], 2);
+
+                if (rc == NGX_ERROR) {
+                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                       "invalid \"hash_key\"");
+                    return NGX_CONF_ERROR;
+                }
+
+                uhcf->hash_key[n] = (u_char) rc;
+            }
+
+            hash_key = 1;
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if ((uhcf->hash == NGX_HTTP_UPSTREAM_DYNAMIC_HASH_SIPHASH) != hash_key) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"hash=siphash\" requires \"hash_key\" "
+                           "and \"hash_key\" requires \"hash=siphash\"");
+        return NGX_CONF_ERROR;
+    }
+
+    if (uhcf->algorithm != NGX_HTTP_UPSTREAM_DYNAMIC_HASH_MAGLEV
+        && uhcf->table_size)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"table_size\" requires \"algorithm=maglev\"");
+        return NGX_CONF_ERROR;
+    }
+
+    if (uhcf->bounded_load && uhcf->shm_zone == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"bounded_load\" requires \"zone\"");
+        return NGX_CONF_ERROR;
+    }
+
+    if (uhcf->slow_start && uhcf->shm_zone == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"slow_start\" requires \"zone\"");
+        return NGX_CONF_ERROR;
+    }
+
+    if (uhcf->slow_start
+        && uhcf->algorithm == NGX_HTTP_UPSTREAM_DYNAMIC_HASH_JUMP)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"slow_start\" cannot be used with "
+                           "\"algorithm=jump\", which ignores weights");
+        return NGX_CONF_ERROR;
+    }
+
+    if (uhcf->stats && uhcf->shm_zone == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"stats\" requires \"zone\"");
+        return NGX_CONF_ERROR;
+    }
+
+    uhcf->upstream = uscf;
+
+    /*
+     * "keepalive" wraps whatever balancer is set when it is parsed, so it
+     * must come after "dynamic_hash"; the upstream is then recognized by
+     * uhcf->upstream rather than by peer.init_upstream
+     */
+
+    if (uscf->peer.init_upstream) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "load balancing method redefined");
+    }
+
+    uscf->peer.init_upstream = ngx_http_upstream_init_dynamic_hash;
+
+    uscf->flags = NGX_HTTP_UPSTREAM_CREATE
+                  |NGX_HTTP_UPSTREAM_MAX_FAILS
+                  |NGX_HTTP_UPSTREAM_FAIL_TIMEOUT
+                  |NGX_HTTP_UPSTREAM_DOWN
+		  |NGX_HTTP_UPSTREAM_WEIGHT
+                  |NGX_HTTP_UPSTREAM_BACKUP;
+
+    //fprintf(stderr, "dynamic func3 %s\n", "hash");
+
+    return NGX_CONF_OK;
+}
+
+static void * ngx_http_upstream_dynamic_hash_create_srv_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_dynamic_hash_conf_t *conf;
+  
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_dynamic_hash_conf_t));
+
+    if (conf == NULL) {
+	return NULL;
+    }
+
+    conf->key.index = NGX_ERROR;
+
+    return conf;
+}
+
+static char *
+ngx_http_upstream_dynamic_hash_admin(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+    clcf->handler = ngx_http_upstream_dynamic_hash_admin_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+/*
+ * GET /location?upstream=NAME                       lists the servers
+ *              [&add=ADDR[&weight=N]]                adds a server
+ *              [&remove=ADDR]                        removes a server
+ *              [&server=ADDR[&weight=N][&down=0|1]]  changes a server
+ *
+ * ADDR is "ip:port" or "[ipv6]:port".  Changes need a zone and report how
+ * many table slots moved to another backend.
+ */
+
+static ngx_int_t
+ngx_http_upstream_dynamic_hash_admin_handler(ngx_http_request_t *r)
+{
+    size_t                                   len;
+    ngx_int_t                                rc, moved, weight, down, n;
+    ngx_uint_t                               i, number, backup, *slots;
+    ngx_str_t                                name, arg, type;
+    ngx_buf_t                               *b;
+    ngx_chain_t                              out;
+    ngx_addr_t                               addr;
+    ngx_http_upstream_srv_conf_t           **uscfp, *uscf;
+    ngx_http_upstream_main_conf_t           *umcf;
+    ngx_http_upstream_dynamic_hash_conf_t   *uhcf;
+    ngx_http_upstream_dynamic_hash_peers_t  *peers;
+
+    if (!(r->method & (NGX_HTTP_GET | NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    if (ngx_http_arg(r, (u_char *) "upstream", 8, &name) != NGX_OK) {
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+
+    uscfp = umcf->upstreams.elts;
+    uscf = NULL;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        uhcf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                           ngx_http_upstream_dynamic_hash_module);
+
+        if (uhcf->upstream == uscfp[i]
+            && uscfp[i]->host.len == name.len
+            && ngx_strncmp(uscfp[i]->host.data, name.data, name.len) == 0)
+        {
+            uscf = uscfp[i];
+            break;
+        }
+    }
+
+    if (uscf == NULL || uscf->peer.data == NULL) {
+        return NGX_HTTP_NOT_FOUND;
+    }
+
+    peers = uscf->peer.data;
+
+    weight = 0;
+
+    if (ngx_http_arg(r, (u_char *) "weight", 6, &arg) == NGX_OK) {
+        weight = ngx_atoi(arg.data, arg.len);
+
+        if (weight == NGX_ERROR || weight == 0) {
+            return NGX_HTTP_BAD_REQUEST;
+        }
+    }
+
+    down = -1;
+
+    if (ngx_http_arg(r, (u_char *) "down", 4, &arg) == NGX_OK) {
+        down = ngx_atoi(arg.data, arg.len);
+
+        if (down != 0 && down != 1) {
+            return NGX_HTTP_BAD_REQUEST;
+        }
+    }
+
+    moved = -1;
+
+    if (ngx_http_arg(r, (u_char *) "add", 3, &arg) == NGX_OK
+        || ngx_http_arg(r, (u_char *) "remove", 6, &arg) == NGX_OK
+        || ngx_http_arg(r, (u_char *) "server", 6, &arg) == NGX_OK)
+    {
+        if (peers->shpool == NULL) {
+            return NGX_HTTP_CONFLICT;
+        }
+
+        if (ngx_http_upstream_dynamic_hash_parse_addr(r->pool, &arg, &addr)
+            != NGX_OK)
+        {
+            return NGX_HTTP_BAD_REQUEST;
+        }
+
+        ngx_shmtx_lock(&peers->shpool->mutex);
+
+        n = ngx_http_upstream_dynamic_hash_find_peer(peers, &addr);
+
+        if (ngx_http_arg(r, (u_char *) "add", 3, &arg) == NGX_OK) {
+            n = ngx_http_upstream_dynamic_hash_add_peer(peers, &addr,
+                                                        weight ? weight : 1);
+            rc = (n >= 0) ? NGX_OK : n;
+
+        } else if (n == NGX_DECLINED) {
+            rc = NGX_DECLINED;
+
+        } else if (ngx_http_arg(r, (u_char *) "remove", 6, &arg) == NGX_OK) {
+            rc = ngx_http_upstream_dynamic_hash_remove_peer(peers, n);
+
+        } else {
+            if (weight) {
+                peers->peer[n].weight = weight;
+            }
+
+            if (down == 0 && peers->peer[n].down) {
+                ngx_http_upstream_dynamic_hash_ramp_up(peers, &peers->peer[n]);
+            }
+
+            if (down != -1) {
+                peers->peer[n].down = down;
+            }
+
+            rc = NGX_OK;
+        }
+
+        if (rc == NGX_OK) {
+            moved = ngx_http_upstream_dynamic_hash_publish(peers);
+            rc = (moved == NGX_ERROR) ? NGX_ERROR : NGX_OK;
+        }
+
+        ngx_shmtx_unlock(&peers->shpool->mutex);
+
+        if (rc == NGX_DECLINED) {
+            return NGX_HTTP_CONFLICT;
+        }
+
+        if (rc == NGX_BUSY) {
+            return NGX_HTTP_SERVICE_UNAVAILABLE;
+        }
+
+        if (rc != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                      "dynamic_hash: \"%V?%V\" moved %i slots",
+                      &r->uri, &r->args, moved);
+    }
+
+    if (peers->shpool) {
+        ngx_shmtx_lock(&peers->shpool->mutex);
+    }
+
+    /* the reply is sized for the peers in use while the zone is held */
+
+    number = peers->number;
+    backup = peers->next ? peers->next->number : 0;
+
+    len = sizeof("moved: \n") - 1 + NGX_INT_T_LEN
+          + sizeof("upstream: \n") - 1 + uscf->host.len
+          + sizeof("generation: \n") - 1 + NGX_ATOMIC_T_LEN
+          + sizeof("table_size: \n") - 1 + NGX_INT_T_LEN
+          + number
+            * (sizeof(" weight= slots= conns= fails= down removed unhealthy"
+                      " slow_start=%\n") - 1
+               + NGX_SOCKADDR_STRLEN + 4 * NGX_INT_T_LEN
+               + 2 * NGX_ATOMIC_T_LEN)
+          + backup
+            * (sizeof("backup  weight= slots= down unhealthy\n") - 1
+               + NGX_SOCKADDR_STRLEN + 3 * NGX_INT_T_LEN)
+          + 2 * (sizeof("select: count= p50<ns p99<ns p999<ns\n") - 1
+                 + 4 * NGX_INT64_LEN);
+
+    b = ngx_create_temp_buf(r->pool, len);
+    slots = ngx_palloc(r->pool, sizeof(ngx_uint_t) * ngx_max(number, backup));
+
+    if (b == NULL || slots == NULL) {
+        if (peers->shpool) {
+            ngx_shmtx_unlock(&peers->shpool->mutex);
+        }
+
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (moved >= 0) {
+        b->last = ngx_sprintf(b->last, "moved: %i\n", moved);
+    }
+
+    b->last = ngx_sprintf(b->last, "upstream: %V\n"
+                                   "generation: %uA\n"
+                                   "table_size: %ui\n",
+                          &uscf->host, peers->generation, peers->table_size);
+
+    ngx_http_upstream_dynamic_hash_slots(peers, slots);
+
+    for (i = 0; i < number; i++) {
+        b->last = ngx_sprintf(b->last,
+                              "%ui %V weight=%i slots=%ui conns=%uA fails=%uA%s%s%s",
+                              i, &peers->peer[i].name, peers->peer[i].weight,
+                              slots[i],
+                              peers->peer[i].conns, peers->peer[i].fails,
+                              peers->peer[i].down ? " down" : "",
+                              peers->peer[i].removed ? " removed" : "",
+                              ngx_http_upstream_dynamic_hash_check_down(
+                                  &peers->peer[i]) ? " unhealthy" : "");
+
+        if (peers->peer[i].ramp != NGX_HTTP_UPSTREAM_DYNAMIC_HASH_RAMP_FULL) {
+            b->last = ngx_sprintf(b->last, " slow_start=%ui%%",
+                                  peers->peer[i].ramp
+                                  * 100 / NGX_HTTP_UPSTREAM_DYNAMIC_HASH_RAMP_FULL);
+        }
+
+        *b->last++ = LF;
+    }
+
+    if (backup) {
+        ngx_http_upstream_dynamic_hash_slots(peers->next, slots);
+    }
+
+    for (i = 0; i < backup; i++) {
+        b->last = ngx_sprintf(b->last, "backup %ui %V weight=%i slots=%ui%s%s\n",
+                              i, &peers->next->peer[i].name,
+                              peers->next->peer[i].weight,
+                              slots[i],
+                              peers->next->peer[i].down ? " down" : "",
+                              ngx_http_upstream_dynamic_hash_check_down(
+                                  &peers->next->peer[i]) ? " unhealthy" : "");
+    }
+
+    if (peers->stats) {
+        b->last = ngx_http_upstream_dynamic_hash_percentiles(b->last, "select",
+                      peers->stats, NGX_HTTP_UPSTREAM_DYNAMIC_HASH_SELECT);
+        b->last = ngx_http_upstream_dynamic_hash_percentiles(b->last, "key",
+                      peers->stats, NGX_HTTP_UPSTREAM_DYNAMIC_HASH_KEY);
+    }
+
+    if (peers->shpool) {
+        ngx_shmtx_unlock(&peers->shpool->mutex);
+    }
+
+    b->last_buf = 1;
+
+    ngx_str_set(&type, "text/plain");
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+    r->headers_out.content_type = type;
+
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_dynamic_hash_parse_addr(ngx_pool_t *pool, ngx_str_t *text,
+                                          ngx_addr_t *addr)
+{
+    u_char               *p, *last;
+    size_t                len;
+    ngx_int_t             port;
+    struct sockaddr_in   *sin;
+#if (NGX_HAVE_INET6)
+    struct sockaddr_in6  *sin6;
+#endif
+
+    if (text->len == 0) {
+        return NGX_ERROR;
+    }
+
+    last = text->data + text->len;
+
+    for (p = last - 1; p > text->data && *p != ':'; p--) { /* void */ }
+
+    if (*p != ':') {
+        return NGX_ERROR;
+    }
+
+    port = ngx_atoi(p + 1, last - p - 1);
+
+    if (port < 1 || port > 65535) {
+        return NGX_ERROR;
+    }
+
+    len = p - text->data;
+    p = text->data;
+
+    if (len > 2 && p[0] == '[' && p[len - 1] == ']') {
+        p++;
+        len -= 2;
+    }
+
+    /* only literal addresses, names would need a blocking resolve */
+
+    if (ngx_parse_addr(pool, addr, p, len) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    switch (addr->sockaddr->sa_family) {
+
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+        sin6 = (struct sockaddr_in6 *) addr->sockaddr;
+        sin6->sin6_port = htons((in_port_t) port);
+        break;
+#endif
+
+    default: /* AF_INET */
+        sin = (struct sockaddr_in *) addr->sockaddr;
+        sin->sin_port = htons((in_port_t) port);
+    }
+
+    addr->name.data = ngx_pnalloc(pool, NGX_SOCKADDR_STRLEN);
+    if (addr->name.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    addr->name.len = ngx_sock_ntop(addr->sockaddr, addr->socklen,
+                                   addr->name.data, NGX_SOCKADDR_STRLEN, 1);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_dynamic_hash_find_peer(ngx_http_upstream_dynamic_hash_peers_t *peers,
+                                         ngx_addr_t *addr)
+{
+    ngx_uint_t                              i;
+    ngx_http_upstream_dynamic_hash_peer_t  *peer;
+
+    for (i = 0; i < peers->number; i++) {
+        peer = &peers->peer[i];
+
+        if (!peer->removed
+            && ngx_cmp_sockaddr(peer->sockaddr, peer->socklen,
+                                addr->sockaddr, addr->socklen, 1)
+               == NGX_OK)
+        {
+            return i;
+        }
+    }
+
+    return NGX_DECLINED;
+}
+
+
+/* slots of every peer of a tier, in one pass over its table */
+
+static void
+ngx_http_upstream_dynamic_hash_slots(ngx_http_upstream_dynamic_hash_peers_t *peers,
+                                     ngx_uint_t *slots)
+{
+    ngx_uint_t  i;
+
+    ngx_memzero(slots, sizeof(ngx_uint_t) * peers->number);
+
+    if (peers->table == NULL) {
+        return;
+    }
+
+    for (i = 0; i < peers->table_size; i++) {
+        slots[peers->table[i]]++;
+    }
+}
+
+
+static ngx_int_t
+ngx_http_upstream_dynamic_hash_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                               i;
+    ngx_http_upstream_srv_conf_t           **uscfp;
+    ngx_http_upstream_main_conf_t           *umcf;
+    ngx_http_upstream_dynamic_hash_conf_t   *uhcf;
+    ngx_event_t                             *ev;
+    ngx_http_upstream_dynamic_hash_peers_t  *peers;
+    ngx_http_upstream_dynamic_hash_stats_t  *stats;
+
+    /* cache helpers run init_process too, but never balance */
+
+    if (ngx_process != NGX_PROCESS_WORKER && ngx_process != NGX_PROCESS_SINGLE) {
+        return NGX_OK;
+    }
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        uhcf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                           ngx_http_upstream_dynamic_hash_module);
+
+        if (uhcf->upstream != uscfp[i]) {
+            continue;
+        }
+
+        peers = uscfp[i]->peer.data;
+
+        if (peers == NULL) {
+            continue;
+        }
+
+#if (NGX_HTTP_SSL)
+        uhcf->ssl_sessions = ngx_pcalloc(cycle->pool,
+                                   sizeof(ngx_ssl_session_t *) * peers->capacity);
+#endif
+
+        /* one worker raises the weights of slow starting backends */
+
+        if (uhcf->slow_start && peers->shpool
+            && (ngx_process == NGX_PROCESS_SINGLE || ngx_worker == 0))
+        {
+            ev = ngx_pcalloc(cycle->pool, sizeof(ngx_event_t));
+            if (ev == NULL) {
+                return NGX_ERROR;
+            }
+
+            ev->handler = ngx_http_upstream_dynamic_hash_ramp_handler;
+            ev->data = uhcf;
+            ev->log = cycle->log;
+            ev->cancelable = 1;
+
+            ngx_add_timer(ev, ngx_http_upstream_dynamic_hash_ramp_tick(uhcf));
+        }
+
+        if (!uhcf->stats || peers->shpool == NULL) {
+            continue;
+        }
+
+        /* a respawned worker continues the histograms of its predecessor */
+
+        ngx_shmtx_lock(&peers->shpool->mutex);
+
+        for (stats = peers->stats; stats; stats = stats->next) {
+            if (stats->worker == ngx_worker) {
+                break;
+            }
+        }
+
+        if (stats == NULL) {
+            stats = ngx_slab_calloc_locked(peers->shpool,
+                                 sizeof(ngx_http_upstream_dynamic_hash_stats_t));
+
+            if (stats) {
+                stats->worker = ngx_worker;
+                stats->next = peers->stats;
+
+                ngx_memory_barrier();
+
+                peers->stats = stats;
+            }
+        }
+
+        ngx_shmtx_unlock(&peers->shpool->mutex);
+
+        if (stats == NULL) {
+            ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                          "dynamic_hash: no memory for stats of upstream "
+                          "\"%V\"", &uscfp[i]->host);
+        }
+
+        uhcf->worker_stats = stats;
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * slow_start: a backend that is added, set back up, or passes its checks
+ * again starts with a tenth of its weight.  The caller holds the zone
+ * mutex and publishes the change.
+ */
+
+static void
+ngx_http_upstream_dynamic_hash_ramp_up(
+    ngx_http_upstream_dynamic_hash_peers_t *peers,
+    ngx_http_upstream_dynamic_hash_peer_t *peer)
+{
+    if (peers->slow_start == 0) {
+        return;
+    }
+
+    peer->ramp = NGX_HTTP_UPSTREAM_DYNAMIC_HASH_RAMP_FULL
+                 / NGX_HTTP_UPSTREAM_DYNAMIC_HASH_RAMP_STEPS;
+    peer->ramp_start = ngx_current_msec;
+}
+
+
+/*
+ * Every tenth of slow_start the weights in effect grow with the time
+ * since each ramp began.  The table is updated incrementally, so a step
+ * only moves the slots the ramping backends gain, and lookups stay a
+ * single slot read.
+ */
+
+static void
+ngx_http_upstream_dynamic_hash_ramp_handler(ngx_event_t *ev)
+{
+    ngx_http_upstream_dynamic_hash_conf_t  *uhcf = ev->data;
+
+    ngx_int_t                                moved;
+    ngx_uint_t                               i, ramp, changed;
+    ngx_msec_int_t                           elapsed;
+    ngx_http_upstream_dynamic_hash_peer_t   *peer;
+    ngx_http_upstream_dynamic_hash_peers_t  *peers;
+
+    peers = uhcf->upstream->peer.data;
+    changed = 0;
+    moved = 0;
+
+    ngx_shmtx_lock(&peers->shpool->mutex);
+
+    for (i = 0; i < peers->number; i++) {
+        peer = &peers->peer[i];
+
+        if (peer->removed
+            || peer->ramp == NGX_HTTP_UPSTREAM_DYNAMIC_HASH_RAMP_FULL)
+        {
+            continue;
+        }
+
+        elapsed = (ngx_msec_int_t) (ngx_current_msec - peer->ramp_start);
+
+        if (elapsed < 0) {
+            elapsed = 0;
+        }
+
+        if ((ngx_msec_t) elapsed >= peers->slow_start) {
+            ramp = NGX_HTTP_UPSTREAM_DYNAMIC_HASH_RAMP_FULL;
+
+        } else {
+            ramp = (uint64_t) NGX_HTTP_UPSTREAM_DYNAMIC_HASH_RAMP_FULL * elapsed
+                   / peers->slow_start;
+            ramp = ngx_max(ramp, NGX_HTTP_UPSTREAM_DYNAMIC_HASH_RAMP_FULL
+                                 / NGX_HTTP_UPSTREAM_DYNAMIC_HASH_RAMP_STEPS);
+        }
+
+        if (ramp != peer->ramp) {
+            peer->ramp = ramp;
+            changed = 1;
+        }
+    }
+
+    if (changed) {
+        moved = ngx_http_upstream_dynamic_hash_publish(peers);
+    }
+
+    ngx_shmtx_unlock(&peers->shpool->mutex);
+
+    if (moved == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ev->log, 0,
+                      "dynamic_hash: failed to update upstream \"%V\"",
+                      &uhcf->upstream->host);
+
+    } else if (changed) {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                       "dynamic_hash: slow start in \"%V\" moved %i slots",
+                       &uhcf->upstream->host, moved);
+    }
+
+    if (ngx_exiting || ngx_quit || ngx_terminate) {
+        return;
+    }
+
+    ngx_add_timer(ev, ngx_http_upstream_dynamic_hash_ramp_tick(uhcf));
+}
+
+
+#if (NGX_HTTP_UPSTREAM_HASH_CHECK)
+
+/*
+ * Runs in the worker doing the checks.  With a zone, a backend failing its
+ * checks hands its slots over to the healthy ones until it passes again;
+ * without one, and in the backup tier, lookups just skip it.
+ */
+
+static void
+ngx_http_upstream_dynamic_hash_check_handler(ngx_uint_t index, ngx_uint_t down,
+    void *data)
+{
+    ngx_http_upstream_dynamic_hash_conf_t  *uhcf = data;
+
+    ngx_int_t                                moved;
+    ngx_uint_t                               i, failing;
+    ngx_http_upstream_dynamic_hash_peer_t   *peer;
+    ngx_http_upstream_dynamic_hash_peers_t  *peers;
+
+    peers = uhcf->upstream->peer.data;
+
+    if (peers == NULL || peers->shpool == NULL) {
+        return;
+    }
+
+    ngx_shmtx_lock(&peers->shpool->mutex);
+
+    for (i = 0; i < peers->number; i++) {
+        peer = &peers->peer[i];
+        failing = ngx_http_upstream_dynamic_hash_check_down(peer);
+
+        if (peer->unhealthy && !failing) {
+            ngx_http_upstream_dynamic_hash_ramp_up(peers, peer);
+        }
+
+        peer->unhealthy = failing;
+    }
+
+    moved = ngx_http_upstream_dynamic_hash_publish(peers);
+
+    ngx_shmtx_unlock(&peers->shpool->mutex);
+
+    if (moved == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                      "dynamic_hash: failed to update upstream \"%V\"",
+                      &uhcf->upstream->host);
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                  "dynamic_hash: a server went %s in upstream \"%V\", "
+                  "moved %i slots", down ? "down" : "up",
+                  &uhcf->upstream->host, moved);
+}
+
+#endif
+
+
+static ngx_inline uint64_t
+ngx_http_upstream_dynamic_hash_clock(void)
+{
+    struct timespec  ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/* bucket n counts durations in [2^(n-1), 2^n) nanoseconds */
+
+static ngx_inline void
+ngx_http_upstream_dynamic_hash_record(ngx_atomic_t *hist, uint64_t start)
+{
+    uint64_t    ns;
+    ngx_uint_t  n;
+
+    ns = ngx_http_upstream_dynamic_hash_clock() - start;
+
+#if (__GNUC__)
+    n = ns ? 64 - __builtin_clzll(ns) : 0;
+#else
+    for (n = 0; ns; n++) {
+        ns >>= 1;
+    }
+#endif
+
+    if (n >= NGX_HTTP_UPSTREAM_DYNAMIC_HASH_BUCKETS) {
+        n = NGX_HTTP_UPSTREAM_DYNAMIC_HASH_BUCKETS - 1;
+    }
+
+    /* only the owning worker writes its histogram */
+
+    hist[n]++;
+}
+
+
+static u_char *
+ngx_http_upstream_dynamic_hash_percentiles(u_char *p, char *metric,
+    ngx_http_upstream_dynamic_hash_stats_t *stats, ngx_uint_t m)
+{
+    uint64_t     hist[NGX_HTTP_UPSTREAM_DYNAMIC_HASH_BUCKETS];
+    uint64_t     total, sum, rank[3];
+    ngx_uint_t   i, n, k;
+    uint64_t     value[3];
+
+    ngx_memzero(hist, sizeof(hist));
+
+    for ( /* void */ ; stats; stats = stats->next) {
+        for (i = 0; i < NGX_HTTP_UPSTREAM_DYNAMIC_HASH_BUCKETS; i++) {
+            hist[i] += stats->hist[m][i];
+        }
+    }
+
+    total = 0;
+
+    for (i = 0; i < NGX_HTTP_UPSTREAM_DYNAMIC_HASH_BUCKETS; i++) {
+        total += hist[i];
+    }
+
+    rank[0] = total / 2;
+    rank[1] = total - total / 100;
+    rank[2] = total - total / 1000;
+
+    sum = 0;
+    k = 0;
+    value[0] = value[1] = value[2] = 0;
+
+    for (n = 0; n < NGX_HTTP_UPSTREAM_DYNAMIC_HASH_BUCKETS && k < 3; n++) {
+        sum += hist[n];
+
+        while (k < 3 && sum > rank[k]) {
+            value[k++] = (uint64_t) 1 << n;
+        }
+    }
+
+    return ngx_sprintf(p, "%s: count=%uL p50<%uLns p99<%uLns p999<%uLns\n",
+                       metric, total, value[0], value[1], value[2]);
+}
+
+
+/*
+ * Jump Consistent Hash (Lamping, Veach): maps a key onto [0, buckets) with
+ * an equal share per bucket and no state; growing the number of buckets
+ * from n to n + 1 only moves 1/(n + 1) of the keys, all to the new one.
+ */
+
+static ngx_uint_t
+ngx_http_upstream_dynamic_hash_jump(uint64_t key, ngx_uint_t buckets)
+{
+    int64_t  b, j;
+
+    b = -1;
+    j = 0;
+
+    while (j < (int64_t) buckets) {
+        b = j;
+        key = key * 2862933555777941757ULL + 1;
+        j = (int64_t) ((b + 1) * ((double) (1LL << 31)
+                                  / (double) ((key >> 33) + 1)));
+    }
+
+    return (ngx_uint_t) b;
+}
+
+
+/*
+ * Rendezvous (highest random weight) hashing: every live backend scores
+ * the key and the highest score wins, retries take the next highest.
+ * Removing a backend only moves its own keys, spread over all the others.
+ * The cost is linear in the number of backends, so it suits upstreams of
+ * up to a few dozen servers.
+ */
+
+static ngx_int_t
+ngx_http_upstream_get_rendezvous_peer(
+    ngx_http_upstream_dynamic_hash_peer_data_t *iphp,
+    ngx_http_upstream_dynamic_hash_peers_t *peers, uintptr_t *tried,
+    time_t now)
+{
+    double                                   score, best_score, spill_score;
+    ngx_int_t                                best, spill;
+    ngx_uint_t                               i, number;
+    ngx_http_upstream_dynamic_hash_peer_t   *peer;
+
+    number = peers->number;
+
+    ngx_http_upstream_dynamic_hash_scores(peers->seeds, number,
+                                          (uint32_t) iphp->hash, iphp->scores);
+
+again:
+
+    best = NGX_BUSY;
+    best_score = 0;
+    spill = NGX_BUSY;
+    spill_score = 0;
+
+    for (i = 0; i < number; i++) {
+        peer = &peers->peer[i];
+
+        if ((tried[ngx_bitvector_index(i)] & ngx_bitvector_bit(i))
+            || peer->down || peer->removed
+            || ngx_http_upstream_dynamic_hash_check_down(peer))
+        {
+            continue;
+        }
+
+        if (ngx_http_upstream_dynamic_hash_failed(peer)
+            && (time_t) peer->until > now)
+        {
+            continue;
+        }
+
+        /*
+         * weighted: w / -ln(u) with u uniform in (0, 1) gives each backend
+         * a w / total_weight chance to win; this stays scalar, one libm
+         * log() per live backend, as an approximation would move keys
+         * between builds and there is no portable vector log
+         */
+
+        if (peers->weighted) {
+            score = (double) peer->weight * peer->ramp
+                    / NGX_HTTP_UPSTREAM_DYNAMIC_HASH_RAMP_FULL
+                    / -log((iphp->scores[i] + 0.5) / 4294967296.0);
+
+        } else {
+            score = iphp->scores[i];
+        }
+
+        if (peers->bounded_load
+            && !ngx_http_upstream_dynamic_hash_failed(peer)
+            && ngx_http_upstream_dynamic_hash_overloaded(peers, peer))
+        {
+            if (spill == NGX_BUSY || score > spill_score) {
+                spill = i;
+                spill_score = score;
+            }
+
+            continue;
+        }
+
+        if (best == NGX_BUSY || score > best_score) {
+            best = i;
+            best_score = score;
+        }
+    }
+
+    if (best == NGX_BUSY) {
+        best = spill;
+    }
+
+    if (best != NGX_BUSY) {
+        peer = &peers->peer[best];
+
+        /* another worker got to probe it first */
+
+        if (ngx_http_upstream_dynamic_hash_failed(peer)
+            && !ngx_http_upstream_dynamic_hash_probe(peer, now))
+        {
+            tried[ngx_bitvector_index(best)] |= ngx_bitvector_bit(best);
+            goto again;
+        }
+    }
+
+    return best;
+}
+
+
+/*
+ * A backend that failed max_fails times in a row is skipped by all
+ * workers until peer->until.  Then the first worker to move peer->until
+ * on by fail_timeout sends it one request, the others keep skipping it;
+ * a success clears the failures, another failure extends the pause.
+ */
+
+static ngx_inline ngx_uint_t
+ngx_http_upstream_dynamic_hash_failed(ngx_http_upstream_dynamic_hash_peer_t *peer)
+{
+    return peer->max_fails && peer->fails >= peer->max_fails;
+}
+
+
+static ngx_uint_t
+ngx_http_upstream_dynamic_hash_probe(ngx_http_upstream_dynamic_hash_peer_t *peer,
+                                     time_t now)
+{
+    ngx_atomic_uint_t  until;
+
+    until = peer->until;
+
+    if ((time_t) until > now) {
+        return 0;
+    }
+
+    return ngx_atomic_cmp_set(&peer->until, until, now + peer->fail_timeout);
+}
+
+
+/*
+ * Bounded loads (Mirrokni et al.): a backend may have at most
+ * (1 + epsilon) times its weighted share of the requests in flight,
+ * counting the one being placed.  Shares are taken of live_weight, so
+ * down, unhealthy and ramping backends do not shrink the others' caps.
+ */
+
+static ngx_uint_t
+ngx_http_upstream_dynamic_hash_overloaded(
+    ngx_http_upstream_dynamic_hash_peers_t *peers,
+    ngx_http_upstream_dynamic_hash_peer_t *peer)
+{
+    uint64_t  limit;
+
+    limit = ((uint64_t) peers->conns + 1) * (100 + peers->bounded_load)
+            * peer->weight * peer->ramp;
+
+    return (uint64_t) peer->conns * 100 * peers->live_weight >= limit;
+}
+
+
+/*
+ * The score is the murmur3 finalizer of the key mixed with the seed; it is
+ * a bijection, so distinct seeds never tie.  The vector loops compute the
+ * same values 8 or 4 backends at a time.
+ */
+
+static void
+ngx_http_upstream_dynamic_hash_scores(uint32_t *seeds, ngx_uint_t n,
+    uint32_t key, uint32_t *scores)
+{
+    uint32_t    h;
+    ngx_uint_t  i;
+
+    i = 0;
+
+#if (NGX_HTTP_UPSTREAM_DYNAMIC_HASH_X86)
+
+    if (ngx_http_upstream_dynamic_hash_avx2) {
+        i = ngx_http_upstream_dynamic_hash_scores_avx2(seeds, n, key, scores);
+    }
+
+#if defined(__SSE2__)
+    else {
+        i = ngx_http_upstream_dynamic_hash_scores_sse2(seeds, n, key, scores);
+    }
+#endif
+
+#endif
+
+    for ( /* void */ ; i < n; i++) {
+        h = seeds[i] ^ key;
+        h ^= h >> 16;
+        h *= 0x85ebca6b;
+        h ^= h >> 13;
+        h *= 0xc2b2ae35;
+        h ^= h >> 16;
+        scores[i] = h;
+    }
+}
+
+
+#if (NGX_HTTP_UPSTREAM_DYNAMIC_HASH_X86)
+
+/* both return the number of scores done, the rest is left to the C loop */
+
+static ngx_uint_t
+ngx_http_upstream_dynamic_hash_scores_avx2(uint32_t *seeds, ngx_uint_t n,
+    uint32_t key, uint32_t *scores)
+{
+    __m256i     v, k;
+    ngx_uint_t  i;
+
+    k = _mm256_set1_epi32((int) key);
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        v = _mm256_xor_si256(_mm256_loadu_si256((__m256i *) &seeds[i]), k);
+        v = _mm256_xor_si256(v, _mm256_srli_epi32(v, 16));
+        v = _mm256_mullo_epi32(v, _mm256_set1_epi32((int) 0x85ebca6b));
+        v = _mm256_xor_si256(v, _mm256_srli_epi32(v, 13));
+        v = _mm256_mullo_epi32(v, _mm256_set1_epi32((int) 0xc2b2ae35));
+        v = _mm256_xor_si256(v, _mm256_srli_epi32(v, 16));
+        _mm256_storeu_si256((__m256i *) &scores[i], v);
+    }
+
+    return i;
+}
+
+
+#if defined(__SSE2__)
+
+/*
+ * SSE2 has no 32-bit lane multiply: the even and the odd lanes are
+ * multiplied as 64-bit products and their low halves put back together
+ */
+
+#define ngx_http_upstream_dynamic_hash_mullo(a, b)                           \
+    _mm_unpacklo_epi32(                                                      \
+        _mm_shuffle_epi32(_mm_mul_epu32(a, b), _MM_SHUFFLE(0, 0, 2, 0)),     \
+        _mm_shuffle_epi32(_mm_mul_epu32(_mm_srli_epi64(a, 32),               \
+                                        _mm_srli_epi64(b, 32)),              \
+                          _MM_SHUFFLE(0, 0, 2, 0)))
+
+static ngx_uint_t
+ngx_http_upstream_dynamic_hash_scores_sse2(uint32_t *seeds, ngx_uint_t n,
+    uint32_t key, uint32_t *scores)
+{
+    __m128i     v, k, m1, m2;
+    ngx_uint_t  i;
+
+    k = _mm_set1_epi32((int) key);
+    m1 = _mm_set1_epi32((int) 0x85ebca6b);
+    m2 = _mm_set1_epi32((int) 0xc2b2ae35);
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        v = _mm_xor_si128(_mm_loadu_si128((__m128i *) &seeds[i]), k);
+        v = _mm_xor_si128(v, _mm_srli_epi32(v, 16));
+        v = ngx_http_upstream_dynamic_hash_mullo(v, m1);
+        v = _mm_xor_si128(v, _mm_srli_epi32(v, 13));
+        v = ngx_http_upstream_dynamic_hash_mullo(v, m2);
+        v = _mm_xor_si128(v, _mm_srli_epi32(v, 16));
+        _mm_storeu_si128((__m128i *) &scores[i], v);
+    }
+
+    return i;
+}
+
+#endif
+
+#endif
+
+
+static uint32_t
+ngx_http_upstream_dynamic_hash_rendezvous_seed(
+    ngx_http_upstream_dynamic_hash_peer_t *peer)
+{
+    char  name[NGX_SOCKADDR_STRLEN + 1];
+
+    ngx_http_upstream_dynamic_hash_identity(peer, name);
+
+    return (uint32_t) ngx_http_upstream_dynamic_hash_xxh64((u_char *) name,
+                                                           strlen(name), 0);
+}
+
+
+static ngx_uint_t
+ngx_http_upstream_dynamic_hash_is_prime(ngx_uint_t n)
+{
+    ngx_uint_t  d;
+
+    if (n < 2) {
+        return 0;
+    }
+
+    for (d = 2; d * d <= n; d++) {
+        if (n % d == 0) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static ngx_uint_t
+ngx_http_upstream_dynamic_hash_table_size(ngx_uint_t n)
+{
+    ngx_uint_t  size;
+
+    size = n * NGX_HTTP_UPSTREAM_DYNAMIC_HASH_SLOTS_PER;
+
+    if (size < NGX_HTTP_UPSTREAM_DYNAMIC_HASH_MIN_SIZE) {
+        return NGX_HTTP_UPSTREAM_DYNAMIC_HASH_MIN_SIZE;
+    }
+
+    if (size >= NGX_HTTP_UPSTREAM_DYNAMIC_HASH_MAX_SIZE) {
+        return NGX_HTTP_UPSTREAM_DYNAMIC_HASH_MAX_SIZE;
+    }
+
+    while (!ngx_http_upstream_dynamic_hash_is_prime(size)) {
+        size++;
+    }
+
+    return size;
+}
+
+/*
+ * Key hashes return 64 bits; the table index is taken from the upper half.
+ * The legacy h1() value is placed there so that its mapping is unchanged.
+ */
+
+static uint64_t
+ngx_http_upstream_dynamic_hash_key(ngx_http_upstream_dynamic_hash_conf_t *uhcf,
+                                   u_char *data, size_t len)
+{
+    switch (uhcf->hash) {
+
+    case NGX_HTTP_UPSTREAM_DYNAMIC_HASH_XXH64:
+        return ngx_http_upstream_dynamic_hash_xxh64(data, len, 0);
+
+    case NGX_HTTP_UPSTREAM_DYNAMIC_HASH_SIPHASH:
+        return ngx_http_upstream_dynamic_hash_siphash(data, len,
+                                                      uhcf->hash_key);
+
+    default: /* NGX_HTTP_UPSTREAM_DYNAMIC_HASH_LEGACY */
+        return (uint64_t) (h1((char *) data, len) & 0x7fffffff) << 33;
+    }
+}
+
+
+/* little-endian loads, as both algorithms are defined */
+
+static ngx_inline uint64_t
+ngx_http_upstream_dynamic_hash_read64(u_char *p)
+{
+    return (uint64_t) p[0] | (uint64_t) p[1] << 8
+           | (uint64_t) p[2] << 16 | (uint64_t) p[3] << 24
+           | (uint64_t) p[4] << 32 | (uint64_t) p[5] << 40
+           | (uint64_t) p[6] << 48 | (uint64_t) p[7] << 56;
+}
+
+
+static ngx_inline uint32_t
+ngx_http_upstream_dynamic_hash_read32(u_char *p)
+{
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8
+           | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+
+#define ngx_rotl64(x, r)  (((x) << (r)) | ((x) >> (64 - (r))))
+
+#define NGX_XXH_PRIME64_1  0x9E3779B185EBCA87ULL
+#define NGX_XXH_PRIME64_2  0xC2B2AE3D27D4EB4FULL
+#define NGX_XXH_PRIME64_3  0x165667B19E3779F9ULL
+#define NGX_XXH_PRIME64_4  0x85EBCA77C2B2AE63ULL
+#define NGX_XXH_PRIME64_5  0x27D4EB2F165667C5ULL
+
+
+static ngx_inline uint64_t
+ngx_http_upstream_dynamic_hash_xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * NGX_XXH_PRIME64_2;
+    acc = ngx_rotl64(acc, 31);
+    return acc * NGX_XXH_PRIME64_1;
+}
+
+
+static ngx_inline uint64_t
+ngx_http_upstream_dynamic_hash_xxh64_merge(uint64_t acc, uint64_t val)
+{
+    acc ^= ngx_http_upstream_dynamic_hash_xxh64_round(0, val);
+    return acc * NGX_XXH_PRIME64_1 + NGX_XXH_PRIME64_4;
+}
+
+
+/* XXH64: four independent 64-bit lanes over 32-byte stripes */
+
+static uint64_t
+ngx_http_upstream_dynamic_hash_xxh64(u_char *p, size_t len, uint64_t seed)
+{
+    u_char    *end, *limit;
+    uint64_t   h, v1, v2, v3, v4;
+
+    end = p + len;
+
+    if (len >= 32) {
+        limit = end - 32;
+
+        v1 = seed + NGX_XXH_PRIME64_1 + NGX_XXH_PRIME64_2;
+        v2 = seed + NGX_XXH_PRIME64_2;
+        v3 = seed;
+        v4 = seed - NGX_XXH_PRIME64_1;
+
+        do {
+            v1 = ngx_http_upstream_dynamic_hash_xxh64_round(v1,
+                            ngx_http_upstream_dynamic_hash_read64(p));
+            v2 = ngx_http_upstream_dynamic_hash_xxh64_round(v2,
+                            ngx_http_upstream_dynamic_hash_read64(p + 8));
+            v3 = ngx_http_upstream_dynamic_hash_xxh64_round(v3,
+                            ngx_http_upstream_dynamic_hash_read64(p + 16));
+            v4 = ngx_http_upstream_dynamic_hash_xxh64_round(v4,
+                            ngx_http_upstream_dynamic_hash_read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+
+        h = ngx_rotl64(v1, 1) + ngx_rotl64(v2, 7)
+            + ngx_rotl64(v3, 12) + ngx_rotl64(v4, 18);
+
+        h = ngx_http_upstream_dynamic_hash_xxh64_merge(h, v1);
+        h = ngx_http_upstream_dynamic_hash_xxh64_merge(h, v2);
+        h = ngx_http_upstream_dynamic_hash_xxh64_merge(h, v3);
+        h = ngx_http_upstream_dynamic_hash_xxh64_merge(h, v4);
+
+    } else {
+        h = seed + NGX_XXH_PRIME64_5;
+    }
+
+    h += (uint64_t) len;
+
+    while (p + 8 <= end) {
+        h ^= ngx_http_upstream_dynamic_hash_xxh64_round(0,
+                            ngx_http_upstream_dynamic_hash_read64(p));
+        h = ngx_rotl64(h, 27) * NGX_XXH_PRIME64_1 + NGX_XXH_PRIME64_4;
+        p += 8;
+    }
+
+    if (p + 4 <= end) {
+        h ^= (uint64_t) ngx_http_upstream_dynamic_hash_read32(p)
+             * NGX_XXH_PRIME64_1;
+        h = ngx_rotl64(h, 23) * NGX_XXH_PRIME64_2 + NGX_XXH_PRIME64_3;
+        p += 4;
+    }
+
+    while (p < end) {
+        h ^= (uint64_t) *p * NGX_XXH_PRIME64_5;
+        h = ngx_rotl64(h, 11) * NGX_XXH_PRIME64_1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= NGX_XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= NGX_XXH_PRIME64_3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+
+#define ngx_sipround(v0, v1, v2, v3)                                         \
+    v0 += v1; v1 = ngx_rotl64(v1, 13); v1 ^= v0; v0 = ngx_rotl64(v0, 32);    \
+    v2 += v3; v3 = ngx_rotl64(v3, 16); v3 ^= v2;                             \
+    v0 += v3; v3 = ngx_rotl64(v3, 21); v3 ^= v0;                             \
+    v2 += v1; v1 = ngx_rotl64(v1, 17); v1 ^= v2; v2 = ngx_rotl64(v2, 32)
+
+
+/* SipHash-2-4 keyed with hash_key= */
+
+static uint64_t
+ngx_http_upstream_dynamic_hash_siphash(u_char *p, size_t len, u_char *key)
+{
+    u_char    *end;
+    uint64_t   k0, k1, v0, v1, v2, v3, m, b;
+
+    k0 = ngx_http_upstream_dynamic_hash_read64(key);
+    k1 = ngx_http_upstream_dynamic_hash_read64(key + 8);
+
+    v0 = k0 ^ 0x736f6d6570736575ULL;
+    v1 = k1 ^ 0x646f72616e646f6dULL;
+    v2 = k0 ^ 0x6c7967656e657261ULL;
+    v3 = k1 ^ 0x7465646279746573ULL;
+
+    end = p + (len & ~(size_t) 7);
+
+    for ( /* void */ ; p != end; p += 8) {
+        m = ngx_http_upstream_dynamic_hash_read64(p);
+
+        v3 ^= m;
+        ngx_sipround(v0, v1, v2, v3);
+        ngx_sipround(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+
+    b = (uint64_t) len << 56;
+
+    switch (len & 7) {
+    case 7: b |= (uint64_t) p[6] << 48; /* fall through */
+    case 6: b |= (uint64_t) p[5] << 40; /* fall through */
+    case 5: b |= (uint64_t) p[4] << 32; /* fall through */
+    case 4: b |= (uint64_t) p[3] << 24; /* fall through */
+    case 3: b |= (uint64_t) p[2] << 16; /* fall through */
+    case 2: b |= (uint64_t) p[1] << 8;  /* fall through */
+    case 1: b |= (uint64_t) p[0];
+    }
+
+    v3 ^= b;
+    ngx_sipround(v0, v1, v2, v3);
+    ngx_sipround(v0, v1, v2, v3);
+    v0 ^= b;
+
+    v2 ^= 0xff;
+    ngx_sipround(v0, v1, v2, v3);
+    ngx_sipround(v0, v1, v2, v3);
+    ngx_sipround(v0, v1, v2, v3);
+    ngx_sipround(v0, v1, v2, v3);
+
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+
+/*
+ * h1() and h2() compute in unsigned arithmetic: the values are the same as
+ * the original signed versions, without their undefined overflow.
+ */
+
+static int h1(char* str, int len) {
+    uint32_t b    = 378551;
+    uint32_t a    = 63689;
+    uint32_t hash = 0;
+    int      i    = 0;
+
+    for(i = 0; i < len; str++, i++)
+    {
+        hash = hash * a + (uint32_t) (*str);
+        a    = a * b;
+    }
+
+    return ngx_http_upstream_dynamic_hash_abs(hash);
+}
+
+static int h2(char* str, int len) {
+    uint32_t hash = 1315423911;
+    int      i    = 0;
+
+    for(i = 0; i < len; str++, i++)
+    {
+        hash ^= ((hash << 5) + (uint32_t) (*str)
+                 + (uint32_t) ((int32_t) hash >> 2));
+    }
+
+    return ngx_http_upstream_dynamic_hash_abs(hash);
+}
+
+/* |INT_MIN| does not fit, it maps to 0 as every caller masks the sign bit */
+
+static int
+ngx_http_upstream_dynamic_hash_abs(uint32_t hash)
+{
+    if (hash & 0x80000000) {
+        hash = (0 - hash) & 0x7fffffff;
+    }
+
+    return (int) hash;
+}
+
+/*
+ * Weights are taken as real proportions: in every round a backend earns
+ * weight / max_weight of a turn and takes one slot per whole turn, so
+ * heavier backends never grab runs of slots.  No backend takes more than
+ * its quota, the largest remainder split of the table from
+ * ngx_http_upstream_dynamic_hash_quota(), so every share is within one
+ * slot of table_size * weight / total_weight.  With equal weights this is
+ * the plain one slot per backend and round fill.
+ *
+ * The permutation of a backend, offset, offset + skip, ... modulo col, is
+ * walked in place: only the current position of each backend is kept.
+ * The fill itself is sequential, as every pick depends on the slots taken
+ * before it; it takes about col * ln(col) steps.
+ */
+
+static ngx_int_t init_peers(int row, int col, uint64_t* weight,
+    ngx_uint_t* quota, int* offset, int* skip, int* entry) {
+
+    int i;
+    int* pos;
+    uint64_t* sum;
+    uint64_t max;
+    int c;
+    int n=0;
+    ngx_uint_t* taken;
+
+    pos = (int*)malloc(sizeof(int) * row);
+    sum = (uint64_t*)malloc(sizeof(uint64_t) * row);
+    taken = (ngx_uint_t*)malloc(sizeof(ngx_uint_t) * row);
+
+    if (pos == NULL || sum == NULL || taken == NULL) {
+        free(taken);
+        free(sum);
+        free(pos);
+        return NGX_ERROR;
+    }
+
+    max = 0;
+    for (i=0; i<row; i++) {
+        pos[i] = offset[i];
+        sum[i] = 0;
+        taken[i] = 0;
+        if (weight[i] > max) {
+            max = weight[i];
+        }
+    }
+
+    for (i=0; i<col; i++) {
+        entry[i] = -1;
+    }
+
+    while (1) {
+        for (i=0; i<row; i++) {
+            if (taken[i] == quota[i]) {
+                continue;
+            }
+            sum[i] += weight[i];
+            if (sum[i] < max) {
+                continue;
+            }
+            sum[i] -= max;
+            /* pos and skip are below col: the sum fits an int */
+            c = pos[i];
+            while (entry[c] >= 0) {
+                c += skip[i];
+                if (c >= col) {
+                    c -= col;
+                }
+            }
+            entry[c] = i;
+            c += skip[i];
+            if (c >= col) {
+                c -= col;
+            }
+            pos[i] = c;
+            taken[i] = taken[i]+1;
+            n = n+1;
+            if (n == col) {
+                goto done;
+            }
+        }
+    }
+
+done:
+
+    free(taken);
+    free(sum);
+    free(pos);
+
+    return NGX_OK;
 }
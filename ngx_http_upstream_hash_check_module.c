@@ -0,0 +1,840 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_event_connect.h>
+#include <ngx_http.h>
+#include <ngx_http_upstream_hash_check_module.h>
+
+
+#define NGX_HTTP_UPSTREAM_HASH_CHECK_TCP    0
+#define NGX_HTTP_UPSTREAM_HASH_CHECK_HTTP   1
+
+/* enough for "HTTP/1.1 200" */
+#define NGX_HTTP_UPSTREAM_HASH_CHECK_BUFFER 128
+
+
+typedef struct {
+    ngx_uint_t                                type;
+    ngx_msec_t                                interval;
+    ngx_msec_t                                timeout;
+    ngx_uint_t                                rise;
+    ngx_uint_t                                fall;
+    ngx_str_t                                 uri;
+    ngx_uint_t                                status;   /* 0: 2xx and 3xx */
+    ngx_str_t                                 request;
+    ngx_uint_t                                number;   /* of checked peers */
+    ngx_http_upstream_srv_conf_t             *upstream; /* NULL: no checks */
+    ngx_http_upstream_hash_check_handler_pt   handler;
+    void                                     *data;
+} ngx_http_upstream_hash_check_srv_conf_t;
+
+/* written by the checking worker only, read by all of them */
+
+typedef struct {
+    ngx_atomic_t                              down;
+    ngx_uint_t                                rise;     /* passes in a row */
+    ngx_uint_t                                fall;     /* failures in a row */
+} ngx_http_upstream_hash_check_slot_t;
+
+typedef struct {
+    ngx_uint_t                                number;
+    ngx_http_upstream_hash_check_slot_t       slot[1];
+} ngx_http_upstream_hash_check_shm_t;
+
+typedef struct {
+    ngx_uint_t                                index;
+    ngx_addr_t                               *addr;
+    ngx_http_upstream_hash_check_srv_conf_t  *conf;
+
+    /* local to the checking worker */
+    ngx_event_t                               timer;
+    ngx_peer_connection_t                     pc;
+    ngx_buf_t                                *buf;
+    size_t                                    sent;
+    unsigned                                  connected:1;
+} ngx_http_upstream_hash_check_peer_t;
+
+typedef struct {
+    ngx_array_t                               peers;
+    ngx_shm_zone_t                           *shm_zone;
+} ngx_http_upstream_hash_check_main_conf_t;
+
+
+static void ngx_http_upstream_hash_check_begin(ngx_event_t *ev);
+static void ngx_http_upstream_hash_check_handler(ngx_event_t *ev);
+static void ngx_http_upstream_hash_check_done(
+    ngx_http_upstream_hash_check_peer_t *peer, ngx_uint_t ok);
+static ngx_int_t ngx_http_upstream_hash_check_test_connect(ngx_connection_t *c);
+static ngx_int_t ngx_http_upstream_hash_check_parse_status(
+    ngx_http_upstream_hash_check_peer_t *peer);
+static char *ngx_http_upstream_hash_check(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static void *ngx_http_upstream_hash_check_create_main_conf(ngx_conf_t *cf);
+static char *ngx_http_upstream_hash_check_init_main_conf(ngx_conf_t *cf,
+    void *conf);
+static void *ngx_http_upstream_hash_check_create_srv_conf(ngx_conf_t *cf);
+static ngx_int_t ngx_http_upstream_hash_check_init_zone(
+    ngx_shm_zone_t *shm_zone, void *data);
+static ngx_int_t ngx_http_upstream_hash_check_init_process(ngx_cycle_t *cycle);
+
+
+static ngx_command_t  ngx_http_upstream_hash_check_commands[] = {
+
+        { ngx_string("hash_check"),
+          NGX_HTTP_UPS_CONF|NGX_CONF_ANY,
+          ngx_http_upstream_hash_check,
+          NGX_HTTP_SRV_CONF_OFFSET,
+          0,
+          NULL },
+
+        ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_upstream_hash_check_module_ctx = {
+        NULL,                                  /* preconfiguration */
+        NULL,                                  /* postconfiguration */
+
+        ngx_http_upstream_hash_check_create_main_conf, /* create main configuration */
+        ngx_http_upstream_hash_check_init_main_conf,   /* init main configuration */
+
+        ngx_http_upstream_hash_check_create_srv_conf,  /* create server configuration */
+        NULL,                                  /* merge server configuration */
+
+        NULL,                                  /* create location configuration */
+        NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_upstream_hash_check_module = {
+        NGX_MODULE_V1,
+        &ngx_http_upstream_hash_check_module_ctx, /* module context */
+        ngx_http_upstream_hash_check_commands,    /* module directives */
+        NGX_HTTP_MODULE,                       /* module type */
+        NULL,                                  /* init master */
+        NULL,                                  /* init module */
+        ngx_http_upstream_hash_check_init_process, /* init process */
+        NULL,                                  /* init thread */
+        NULL,                                  /* exit thread */
+        NULL,                                  /* exit process */
+        NULL,                                  /* exit master */
+        NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_http_upstream_hash_check_shm_t  *ngx_http_upstream_hash_check_shm;
+
+
+/*
+ * Called by the balancers from their init_upstream.  Returns the index to
+ * pass to peer_down(), or NGX_DECLINED if the upstream has no hash_check.
+ */
+
+ngx_int_t
+ngx_http_upstream_hash_check_add_peer(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us, ngx_addr_t *addr)
+{
+    ngx_http_upstream_hash_check_peer_t       *peer;
+    ngx_http_upstream_hash_check_srv_conf_t   *hccf;
+    ngx_http_upstream_hash_check_main_conf_t  *hcmcf;
+
+    hccf = ngx_http_conf_upstream_srv_conf(us,
+                                           ngx_http_upstream_hash_check_module);
+
+    if (hccf->upstream != us) {
+        return NGX_DECLINED;
+    }
+
+    hcmcf = ngx_http_conf_get_module_main_conf(cf,
+                                           ngx_http_upstream_hash_check_module);
+
+    peer = ngx_array_push(&hcmcf->peers);
+    if (peer == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(peer, sizeof(ngx_http_upstream_hash_check_peer_t));
+
+    peer->index = hcmcf->peers.nelts - 1;
+    peer->addr = addr;
+    peer->conf = hccf;
+
+    hccf->number++;
+
+    return peer->index;
+}
+
+
+ngx_int_t
+ngx_http_upstream_hash_check_set_handler(ngx_http_upstream_srv_conf_t *us,
+    ngx_http_upstream_hash_check_handler_pt handler, void *data)
+{
+    ngx_http_upstream_hash_check_srv_conf_t  *hccf;
+
+    hccf = ngx_http_conf_upstream_srv_conf(us,
+                                           ngx_http_upstream_hash_check_module);
+
+    if (hccf->upstream != us) {
+        return NGX_DECLINED;
+    }
+
+    hccf->handler = handler;
+    hccf->data = data;
+
+    return NGX_OK;
+}
+
+
+ngx_uint_t
+ngx_http_upstream_hash_check_peer_down(ngx_uint_t index)
+{
+    ngx_http_upstream_hash_check_shm_t  *shm;
+
+    shm = ngx_http_upstream_hash_check_shm;
+
+    if (shm == NULL || index >= shm->number) {
+        return 0;
+    }
+
+    return shm->slot[index].down;
+}
+
+
+/*
+ * One check per backend and interval: connect, and for type=http send a
+ * GET and read the status line.  Everything runs off the event loop of
+ * the checking worker and a check never outlives its timeout.
+ */
+
+static void
+ngx_http_upstream_hash_check_begin(ngx_event_t *ev)
+{
+    ngx_int_t                             rc;
+    ngx_connection_t                     *c;
+    ngx_http_upstream_hash_check_peer_t  *peer;
+
+    peer = ev->data;
+
+    if (ngx_exiting || ngx_quit || ngx_terminate) {
+        return;
+    }
+
+    ngx_memzero(&peer->pc, sizeof(ngx_peer_connection_t));
+
+    peer->pc.sockaddr = peer->addr->sockaddr;
+    peer->pc.socklen = peer->addr->socklen;
+    peer->pc.name = &peer->addr->name;
+    peer->pc.get = ngx_event_get_peer;
+    peer->pc.log = ev->log;
+    peer->pc.log_error = NGX_ERROR_INFO;
+
+    peer->sent = 0;
+    peer->connected = 0;
+
+    rc = ngx_event_connect_peer(&peer->pc);
+
+    if (rc == NGX_ERROR || rc == NGX_DECLINED || rc == NGX_BUSY) {
+        ngx_http_upstream_hash_check_done(peer, 0);
+        return;
+    }
+
+    c = peer->pc.connection;
+
+    c->data = peer;
+    c->read->handler = ngx_http_upstream_hash_check_handler;
+    c->write->handler = ngx_http_upstream_hash_check_handler;
+
+    if (peer->buf) {
+        peer->buf->pos = peer->buf->start;
+        peer->buf->last = peer->buf->start;
+    }
+
+    /* one timer for the whole check */
+
+    ngx_add_timer(c->write, peer->conf->timeout);
+
+    if (rc == NGX_OK) {
+        ngx_http_upstream_hash_check_handler(c->write);
+    }
+}
+
+
+static void
+ngx_http_upstream_hash_check_handler(ngx_event_t *ev)
+{
+    ssize_t                                   n;
+    ngx_int_t                                 rc;
+    ngx_buf_t                                *b;
+    ngx_connection_t                         *c;
+    ngx_http_upstream_hash_check_peer_t      *peer;
+    ngx_http_upstream_hash_check_srv_conf_t  *hccf;
+
+    c = ev->data;
+    peer = c->data;
+    hccf = peer->conf;
+
+    if (ev->timedout) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                       "hash_check: \"%V\" timed out", &peer->addr->name);
+
+        ngx_http_upstream_hash_check_done(peer, 0);
+        return;
+    }
+
+    if (!peer->connected) {
+        if (ngx_http_upstream_hash_check_test_connect(c) != NGX_OK) {
+            ngx_http_upstream_hash_check_done(peer, 0);
+            return;
+        }
+
+        if (hccf->type == NGX_HTTP_UPSTREAM_HASH_CHECK_TCP) {
+            ngx_http_upstream_hash_check_done(peer, 1);
+            return;
+        }
+
+        peer->connected = 1;
+    }
+
+    while (peer->sent < hccf->request.len) {
+        n = c->send(c, hccf->request.data + peer->sent,
+                    hccf->request.len - peer->sent);
+
+        if (n == NGX_ERROR) {
+            ngx_http_upstream_hash_check_done(peer, 0);
+            return;
+        }
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+                ngx_http_upstream_hash_check_done(peer, 0);
+            }
+
+            return;
+        }
+
+        peer->sent += n;
+    }
+
+    b = peer->buf;
+
+    for ( ;; ) {
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+                ngx_http_upstream_hash_check_done(peer, 0);
+            }
+
+            return;
+        }
+
+        if (n == NGX_ERROR || n == 0) {
+            ngx_http_upstream_hash_check_done(peer, 0);
+            return;
+        }
+
+        b->last += n;
+
+        rc = ngx_http_upstream_hash_check_parse_status(peer);
+
+        if (rc == NGX_AGAIN && b->last < b->end) {
+            continue;
+        }
+
+        ngx_http_upstream_hash_check_done(peer, rc == NGX_OK);
+        return;
+    }
+}
+
+
+/*
+ * A backend goes down after "fall" failed checks in a row and comes back
+ * after "rise" passed ones; the balancer of the upstream is told about
+ * both changes.
+ */
+
+static void
+ngx_http_upstream_hash_check_done(ngx_http_upstream_hash_check_peer_t *peer,
+    ngx_uint_t ok)
+{
+    ngx_uint_t                                changed;
+    ngx_http_upstream_hash_check_slot_t      *slot;
+    ngx_http_upstream_hash_check_srv_conf_t  *hccf;
+
+    if (peer->pc.connection) {
+        ngx_close_connection(peer->pc.connection);
+        peer->pc.connection = NULL;
+    }
+
+    hccf = peer->conf;
+    slot = &ngx_http_upstream_hash_check_shm->slot[peer->index];
+    changed = 0;
+
+    if (ok) {
+        slot->fall = 0;
+
+        if (slot->rise < hccf->rise) {
+            slot->rise++;
+        }
+
+        if (slot->down && slot->rise >= hccf->rise) {
+            slot->down = 0;
+            changed = 1;
+        }
+
+    } else {
+        slot->rise = 0;
+
+        if (slot->fall < hccf->fall) {
+            slot->fall++;
+        }
+
+        if (!slot->down && slot->fall >= hccf->fall) {
+            slot->down = 1;
+            changed = 1;
+        }
+    }
+
+    if (changed) {
+        ngx_log_error(NGX_LOG_WARN, peer->timer.log, 0,
+                      "hash_check: server %V of upstream \"%V\" is %s",
+                      &peer->addr->name, &hccf->upstream->host,
+                      slot->down ? "down" : "up");
+
+        if (hccf->handler) {
+            hccf->handler(peer->index, slot->down, hccf->data);
+        }
+    }
+
+    if (ngx_exiting || ngx_quit || ngx_terminate) {
+        return;
+    }
+
+    ngx_add_timer(&peer->timer, hccf->interval);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_hash_check_test_connect(ngx_connection_t *c)
+{
+    int        err;
+    socklen_t  len;
+
+    err = 0;
+    len = sizeof(int);
+
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len) == -1) {
+        err = ngx_socket_errno;
+    }
+
+    if (err) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, err,
+                       "hash_check: connect() failed");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+/* NGX_OK on the expected status, NGX_AGAIN until the status line is in */
+
+static ngx_int_t
+ngx_http_upstream_hash_check_parse_status(
+    ngx_http_upstream_hash_check_peer_t *peer)
+{
+    u_char     *p;
+    ngx_int_t   status;
+
+    p = peer->buf->pos;
+
+    if ((size_t) (peer->buf->last - p) < sizeof("HTTP/1.x 200") - 1) {
+        return NGX_AGAIN;
+    }
+
+    if (ngx_strncmp(p, "HTTP/1.", 7) != 0 || p[8] != ' ') {
+        return NGX_ERROR;
+    }
+
+    status = ngx_atoi(p + 9, 3);
+
+    if (status == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, peer->timer.log, 0,
+                   "hash_check: \"%V\" status %i", &peer->addr->name, status);
+
+    if (peer->conf->status) {
+        return ((ngx_uint_t) status == peer->conf->status) ? NGX_OK
+                                                           : NGX_DECLINED;
+    }
+
+    return (status >= 200 && status < 400) ? NGX_OK : NGX_DECLINED;
+}
+
+
+/*
+ * hash_check [type=tcp|http] [interval=time] [timeout=time] [rise=number]
+ *            [fall=number] [uri=uri] [status=code]
+ */
+
+static char *
+ngx_http_upstream_hash_check(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_hash_check_srv_conf_t  *hccf = conf;
+
+    u_char                        *p;
+    ngx_int_t                      n;
+    ngx_str_t                     *value, s;
+    ngx_uint_t                     i, http_only;
+    ngx_http_upstream_srv_conf_t  *uscf;
+
+    if (hccf->upstream) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+    http_only = 0;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strcmp(value[i].data, "type=tcp") == 0) {
+            hccf->type = NGX_HTTP_UPSTREAM_HASH_CHECK_TCP;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "type=http") == 0) {
+            hccf->type = NGX_HTTP_UPSTREAM_HASH_CHECK_HTTP;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+            s.len = value[i].len - 9;
+            s.data = &value[i].data[9];
+
+            hccf->interval = ngx_parse_time(&s, 0);
+
+            if (hccf->interval == (ngx_msec_t) NGX_ERROR
+                || hccf->interval == 0)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+            s.len = value[i].len - 8;
+            s.data = &value[i].data[8];
+
+            hccf->timeout = ngx_parse_time(&s, 0);
+
+            if (hccf->timeout == (ngx_msec_t) NGX_ERROR
+                || hccf->timeout == 0)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "rise=", 5) == 0) {
+            n = ngx_atoi(&value[i].data[5], value[i].len - 5);
+
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hccf->rise = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "fall=", 5) == 0) {
+            n = ngx_atoi(&value[i].data[5], value[i].len - 5);
+
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hccf->fall = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "uri=", 4) == 0) {
+            hccf->uri.len = value[i].len - 4;
+            hccf->uri.data = &value[i].data[4];
+
+            if (hccf->uri.len == 0 || hccf->uri.data[0] != '/') {
+                goto invalid;
+            }
+
+            http_only = 1;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "status=", 7) == 0) {
+            n = ngx_atoi(&value[i].data[7], value[i].len - 7);
+
+            if (n < 100 || n > 599) {
+                goto invalid;
+            }
+
+            hccf->status = n;
+            http_only = 1;
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if (http_only && hccf->type != NGX_HTTP_UPSTREAM_HASH_CHECK_HTTP) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"uri=\" and \"status=\" require \"type=http\"");
+        return NGX_CONF_ERROR;
+    }
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    hccf->upstream = uscf;
+
+    if (hccf->type == NGX_HTTP_UPSTREAM_HASH_CHECK_HTTP) {
+        hccf->request.len = sizeof("GET  HTTP/1.0" CRLF "Host: " CRLF
+                                   "Connection: close" CRLF CRLF) - 1
+                            + hccf->uri.len + uscf->host.len;
+
+        hccf->request.data = ngx_pnalloc(cf->pool, hccf->request.len);
+        if (hccf->request.data == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        p = ngx_sprintf(hccf->request.data, "GET %V HTTP/1.0" CRLF
+                                            "Host: %V" CRLF
+                                            "Connection: close" CRLF CRLF,
+                        &hccf->uri, &uscf->host);
+
+        hccf->request.len = p - hccf->request.data;
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static void *
+ngx_http_upstream_hash_check_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_hash_check_main_conf_t  *hcmcf;
+
+    hcmcf = ngx_pcalloc(cf->pool,
+                        sizeof(ngx_http_upstream_hash_check_main_conf_t));
+    if (hcmcf == NULL) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&hcmcf->peers, cf->pool, 16,
+                       sizeof(ngx_http_upstream_hash_check_peer_t))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    return hcmcf;
+}
+
+
+/*
+ * Runs after the upstream module has initialized the balancers, so all
+ * checked backends are known and the zone can be sized for them.
+ */
+
+static char *
+ngx_http_upstream_hash_check_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_http_upstream_hash_check_main_conf_t  *hcmcf = conf;
+
+    size_t                                    size;
+    ngx_str_t                                 name;
+    ngx_uint_t                                i;
+    ngx_http_upstream_srv_conf_t            **uscfp;
+    ngx_http_upstream_main_conf_t            *umcf;
+    ngx_http_upstream_hash_check_srv_conf_t  *hccf;
+
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        /* implicit upstreams of proxy_pass and the like have no srv_conf */
+
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        hccf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                           ngx_http_upstream_hash_check_module);
+
+        if (hccf->upstream == uscfp[i] && hccf->number == 0) {
+            ngx_log_error(NGX_LOG_WARN, cf->log, 0,
+                          "hash_check in upstream \"%V\" is ignored, "
+                          "it needs dynamic_hash or myhash", &uscfp[i]->host);
+        }
+    }
+
+    if (hcmcf->peers.nelts == 0) {
+        return NGX_CONF_OK;
+    }
+
+    ngx_str_set(&name, "upstream_hash_check");
+
+    size = 8 * ngx_pagesize + sizeof(ngx_http_upstream_hash_check_shm_t)
+           + sizeof(ngx_http_upstream_hash_check_slot_t) * hcmcf->peers.nelts;
+
+    hcmcf->shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                            &ngx_http_upstream_hash_check_module);
+    if (hcmcf->shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    hcmcf->shm_zone->init = ngx_http_upstream_hash_check_init_zone;
+    hcmcf->shm_zone->data = hcmcf;
+
+    return NGX_CONF_OK;
+}
+
+
+static void *
+ngx_http_upstream_hash_check_create_srv_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_hash_check_srv_conf_t  *hccf;
+
+    hccf = ngx_pcalloc(cf->pool,
+                       sizeof(ngx_http_upstream_hash_check_srv_conf_t));
+    if (hccf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     hccf->status = 0;
+     *     hccf->upstream = NULL;
+     *     hccf->handler = NULL;
+     */
+
+    hccf->type = NGX_HTTP_UPSTREAM_HASH_CHECK_TCP;
+    hccf->interval = 5000;
+    hccf->timeout = 1000;
+    hccf->rise = 2;
+    hccf->fall = 3;
+    ngx_str_set(&hccf->uri, "/");
+
+    return hccf;
+}
+
+
+/*
+ * The zone size follows the number of checked backends, so a zone reused
+ * by a reload has as many slots.  Their indices may now belong to other
+ * backends: every backend starts as up again.
+ */
+
+static ngx_int_t
+ngx_http_upstream_hash_check_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_upstream_hash_check_shm_t        *oshm = data;
+
+    ngx_uint_t                                 n;
+    ngx_slab_pool_t                           *shpool;
+    ngx_http_upstream_hash_check_shm_t        *shm;
+    ngx_http_upstream_hash_check_main_conf_t  *hcmcf;
+
+    hcmcf = shm_zone->data;
+    n = hcmcf->peers.nelts;
+
+    if (oshm && oshm->number == n) {
+        shm = oshm;
+
+    } else {
+        shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+        shm = ngx_slab_alloc(shpool, sizeof(ngx_http_upstream_hash_check_shm_t)
+                             + sizeof(ngx_http_upstream_hash_check_slot_t) * n);
+        if (shm == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    ngx_memzero(shm->slot, sizeof(ngx_http_upstream_hash_check_slot_t) * n);
+    shm->number = n;
+
+    shm_zone->data = shm;
+
+    return NGX_OK;
+}
+
+
+/*
+ * Every worker reads the states, only the first one (or the single
+ * process) runs the checks.  The check timers are cancelable and not
+ * rearmed once the worker is shutting down.
+ */
+
+static ngx_int_t
+ngx_http_upstream_hash_check_init_process(ngx_cycle_t *cycle)
+{
+    ngx_msec_t                                 delay;
+    ngx_uint_t                                 i;
+    ngx_http_upstream_hash_check_peer_t       *peer;
+    ngx_http_upstream_hash_check_main_conf_t  *hcmcf;
+
+    if (ngx_process != NGX_PROCESS_WORKER && ngx_process != NGX_PROCESS_SINGLE) {
+        return NGX_OK;
+    }
+
+    hcmcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                           ngx_http_upstream_hash_check_module);
+
+    if (hcmcf == NULL || hcmcf->shm_zone == NULL) {
+        return NGX_OK;
+    }
+
+    ngx_http_upstream_hash_check_shm = hcmcf->shm_zone->data;
+
+    if (ngx_process == NGX_PROCESS_WORKER && ngx_worker != 0) {
+        return NGX_OK;
+    }
+
+    peer = hcmcf->peers.elts;
+
+    for (i = 0; i < hcmcf->peers.nelts; i++) {
+
+        if (peer[i].conf->type == NGX_HTTP_UPSTREAM_HASH_CHECK_HTTP) {
+            peer[i].buf = ngx_create_temp_buf(cycle->pool,
+                                         NGX_HTTP_UPSTREAM_HASH_CHECK_BUFFER);
+            if (peer[i].buf == NULL) {
+                return NGX_ERROR;
+            }
+        }
+
+        peer[i].timer.handler = ngx_http_upstream_hash_check_begin;
+        peer[i].timer.data = &peer[i];
+        peer[i].timer.log = cycle->log;
+        peer[i].timer.cancelable = 1;
+
+        /* spread the first checks over one interval */
+
+        delay = ngx_random() % peer[i].conf->interval;
+
+        ngx_add_timer(&peer[i].timer, delay + 1);
+    }
+
+    return NGX_OK;
+}
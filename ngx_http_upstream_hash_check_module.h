@@ -0,0 +1,24 @@
+#ifndef _NGX_HTTP_UPSTREAM_HASH_CHECK_MODULE_H_INCLUDED_
+#define _NGX_HTTP_UPSTREAM_HASH_CHECK_MODULE_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+/* called in the checking worker when a backend goes down or comes back */
+
+typedef void (*ngx_http_upstream_hash_check_handler_pt)(ngx_uint_t index,
+    ngx_uint_t down, void *data);
+
+
+ngx_int_t ngx_http_upstream_hash_check_add_peer(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us, ngx_addr_t *addr);
+ngx_int_t ngx_http_upstream_hash_check_set_handler(
+    ngx_http_upstream_srv_conf_t *us,
+    ngx_http_upstream_hash_check_handler_pt handler, void *data);
+ngx_uint_t ngx_http_upstream_hash_check_peer_down(ngx_uint_t index);
+
+
+#endif /* _NGX_HTTP_UPSTREAM_HASH_CHECK_MODULE_H_INCLUDED_ */
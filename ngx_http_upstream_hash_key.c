@@ -0,0 +1,126 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_http_upstream_hash_key.h>
+
+
+ngx_int_t
+ngx_http_upstream_hash_key_compile(ngx_conf_t *cf, ngx_str_t *source,
+    ngx_http_upstream_hash_key_t *key)
+{
+    u_char                      ch;
+    ngx_str_t                   name;
+    ngx_uint_t                  i;
+    ngx_array_t                *lengths, *values;
+    ngx_http_script_compile_t   sc;
+
+    lengths = NULL;
+    values = NULL;
+
+    ngx_memzero(&sc, sizeof(ngx_http_script_compile_t));
+
+    sc.cf = cf;
+    sc.source = source;
+    sc.lengths = &lengths;
+    sc.values = &values;
+    sc.complete_lengths = 1;
+    sc.complete_values = 1;
+
+    if (ngx_http_script_compile(&sc) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    key->lengths = lengths ? lengths->elts : NULL;
+    key->values = values ? values->elts : NULL;
+    key->index = NGX_ERROR;
+    key->binary_addr = 0;
+
+    name = *source;
+
+    for (i = 1; i < name.len; i++) {
+        ch = name.data[i];
+
+        if (!((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z')
+              || (ch >= '0' && ch <= '9') || ch == '_'))
+        {
+            break;
+        }
+    }
+
+    if (name.len > 1 && name.data[0] == '$' && i == name.len) {
+        name.data++;
+        name.len--;
+
+        key->index = ngx_http_get_variable_index(cf, &name);
+        if (key->index == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        key->binary_addr = (name.len == sizeof("binary_remote_addr") - 1
+                            && ngx_strncmp(name.data, "binary_remote_addr",
+                                           name.len) == 0);
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * A key that is a single variable is read directly; $binary_remote_addr
+ * is taken from the client sockaddr, which yields the same bytes.
+ */
+
+ngx_int_t
+ngx_http_upstream_hash_key_eval(ngx_http_request_t *r,
+    ngx_http_upstream_hash_key_t *key, ngx_str_t *val)
+{
+    struct sockaddr_in          *sin;
+#if (NGX_HAVE_INET6)
+    struct sockaddr_in6         *sin6;
+#endif
+    ngx_http_variable_value_t   *vv;
+
+    if (key->binary_addr) {
+
+        switch (r->connection->sockaddr->sa_family) {
+
+        case AF_INET:
+            sin = (struct sockaddr_in *) r->connection->sockaddr;
+            val->data = (u_char *) &sin->sin_addr;
+            val->len = sizeof(struct in_addr);
+            return NGX_OK;
+
+#if (NGX_HAVE_INET6)
+        case AF_INET6:
+            sin6 = (struct sockaddr_in6 *) r->connection->sockaddr;
+            val->data = sin6->sin6_addr.s6_addr;
+            val->len = sizeof(struct in6_addr);
+            return NGX_OK;
+#endif
+        }
+    }
+
+    if (key->index != NGX_ERROR) {
+        vv = ngx_http_get_flushed_variable(r, key->index);
+
+        if (vv == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (vv->not_found) {
+            ngx_str_null(val);
+            return NGX_OK;
+        }
+
+        val->data = vv->data;
+        val->len = vv->len;
+
+        return NGX_OK;
+    }
+
+    if (ngx_http_script_run(r, val, key->lengths, 0, key->values) == NULL) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
@@ -0,0 +1,26 @@
+#ifndef _NGX_HTTP_UPSTREAM_HASH_KEY_H_INCLUDED_
+#define _NGX_HTTP_UPSTREAM_HASH_KEY_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+/* the key of "dynamic_hash" and "myhash" */
+
+typedef struct {
+    void          *lengths;        /* compiled script codes */
+    void          *values;
+    ngx_int_t      index;          /* of a single variable key, or NGX_ERROR */
+    ngx_flag_t     binary_addr;
+} ngx_http_upstream_hash_key_t;
+
+
+ngx_int_t ngx_http_upstream_hash_key_compile(ngx_conf_t *cf,
+    ngx_str_t *source, ngx_http_upstream_hash_key_t *key);
+ngx_int_t ngx_http_upstream_hash_key_eval(ngx_http_request_t *r,
+    ngx_http_upstream_hash_key_t *key, ngx_str_t *val);
+
+
+#endif /* _NGX_HTTP_UPSTREAM_HASH_KEY_H_INCLUDED_ */
@@ -1,19 +1,30 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_http.h>
+#include <ngx_http_upstream_hash_key.h>
 
 #if (NGX_HTTP_HEALTHCHECK)
 #include <ngx_http_healthcheck_module.h>
 #endif
 
+#if (NGX_HTTP_UPSTREAM_HASH_CHECK)
+#include <ngx_http_upstream_hash_check_module.h>
+#endif
+
 #define ngx_bitvector_index(index) (index / (8 * sizeof(uintptr_t)))
 #define ngx_bitvector_bit(index) ((uintptr_t) 1 << (index % (8 * sizeof(uintptr_t))))
 
+#define NGX_HTTP_UPSTREAM_MYHASH_VNODES      160
+#define NGX_HTTP_UPSTREAM_MYHASH_MAX_VNODES  4096
+#define NGX_HTTP_UPSTREAM_MYHASH_MAX_POINTS  (1 << 24)
+
 
 typedef struct {
-    ngx_array_t  *values;
-    ngx_array_t  *lengths;
+    ngx_http_upstream_hash_key_t  key;
     ngx_uint_t    retries;
+    ngx_flag_t    full_hash;
+    ngx_flag_t    stride;
+    ngx_uint_t    vnodes;
 } ngx_http_upstream_myhash_conf_t;
 
 
@@ -26,6 +37,9 @@ typedef struct {
 #if (NGX_HTTP_HEALTHCHECK)
     ngx_int_t                       health_index;
 #endif
+#if (NGX_HTTP_UPSTREAM_HASH_CHECK)
+    ngx_int_t                       check_index;
+#endif
 #if (NGX_HTTP_SSL)
     ngx_ssl_session_t              *ssl_session;   /* local to a process */
 #endif
@@ -35,12 +49,28 @@ typedef struct {
     ngx_uint_t                        number;
     ngx_uint_t                        total_weight;
     unsigned                          weighted:1;
+    unsigned                          full_hash:1;
+    unsigned                          stride:1;
+    ngx_uint_t                       *cumulative;   /* running weight sums */
+    ngx_uint_t                        ring_points;
+    uint32_t                         *ring;         /* sorted point hashes */
+    uint32_t                         *ring_peer;
     ngx_http_upstream_myhash_peer_t     peer[0];
 } ngx_http_upstream_myhash_peers_t;
 
+#define ngx_http_upstream_myhash_positions(peers)                            \
+    ((peers)->ring ? (peers)->ring_points                                    \
+     : (peers)->weighted ? (peers)->total_weight : (peers)->number)
+
+typedef struct {
+    uint32_t                          hash;
+    uint32_t                          peer;
+} ngx_http_upstream_myhash_point_t;
+
 typedef struct {
     ngx_http_upstream_myhash_peers_t   *peers;
     uint32_t                          hash;
+    uint32_t                          stride;
     ngx_str_t                         current_key;
     ngx_str_t                         original_key;
     ngx_uint_t                        try_i;
@@ -50,6 +80,14 @@ typedef struct {
 
 static ngx_uint_t ngx_http_upstream_get_hash_peer_index(
     ngx_http_upstream_myhash_peer_data_t *uhpd);
+static ngx_uint_t ngx_http_upstream_myhash_position(
+    ngx_http_upstream_myhash_peers_t *peers, uint32_t hash);
+static ngx_int_t ngx_http_upstream_myhash_init_ring(ngx_conf_t *cf,
+    ngx_http_upstream_myhash_peers_t *peers, ngx_uint_t vnodes);
+static int ngx_libc_cdecl ngx_http_upstream_myhash_cmp_points(const void *one,
+    const void *two);
+static ngx_uint_t ngx_http_upstream_myhash_find_point(
+    ngx_http_upstream_myhash_peers_t *peers, uint32_t hash);
 static void ngx_http_upstream_myhash_next_peer(ngx_http_upstream_myhash_peer_data_t *uhpd,
         ngx_uint_t *tries, ngx_log_t *log);
 static ngx_int_t ngx_http_upstream_init_hash_peer(ngx_http_request_t *r,
@@ -70,13 +108,16 @@ static char *ngx_http_upstream_myhash_again(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static ngx_int_t ngx_http_upstream_init_hash(ngx_conf_t *cf,
     ngx_http_upstream_srv_conf_t *us);
-static ngx_uint_t ngx_http_upstream_myhash_crc32(u_char *keydata, size_t keylen);
+static uint32_t ngx_http_upstream_myhash_stride(
+    ngx_http_upstream_myhash_peers_t *peers, uint32_t hash);
+static ngx_uint_t ngx_http_upstream_myhash_crc32(
+    ngx_http_upstream_myhash_peers_t *peers, u_char *keydata, size_t keylen);
 static void *ngx_http_upstream_myhash_create_conf(ngx_conf_t *cf);
 
 
 static ngx_command_t  ngx_http_upstream_myhash_commands[] = {
     { ngx_string("myhash"),
-      NGX_HTTP_UPS_CONF|NGX_CONF_NOARGS,
+      NGX_HTTP_UPS_CONF|NGX_CONF_1MORE,
       ngx_http_upstream_myhash,
       0,
       0,
@@ -124,28 +165,200 @@ ngx_module_t  ngx_http_upstream_myhash_module = {
 };
 
 
+/*
+ * The weighted lookup picks the first peer whose running weight sum
+ * exceeds hash % total_weight, the same peer the former linear walk
+ * found.  The binary search is branchless: the loop runs log2(number)
+ * times whatever the key and compiles to conditional moves.
+ *
+ * With "retry=stride" uhpd->hash holds a lookup position (a peer, a weight
+ * unit or a ring point) rather than the key hash, see
+ * ngx_http_upstream_myhash_stride().
+ */
+
 static ngx_uint_t
 ngx_http_upstream_get_hash_peer_index(ngx_http_upstream_myhash_peer_data_t *uhpd)
 {
-    ngx_int_t   w;
-    ngx_uint_t  i;
+    ngx_uint_t   w, n, half, *base;
+
+    w = uhpd->hash;
+
+    if (!uhpd->peers->stride) {
+        w = ngx_http_upstream_myhash_position(uhpd->peers, uhpd->hash);
+    }
+
+    if (uhpd->peers->ring) {
+        return uhpd->peers->ring_peer[w];
+    }
 
     if (!uhpd->peers->weighted) {
-        return uhpd->hash % uhpd->peers->number;
+        return w;
+    }
+
+    base = uhpd->peers->cumulative;
+    n = uhpd->peers->number;
+
+    while (n > 1) {
+        half = n / 2;
+        base = (base[half - 1] <= w) ? base + half : base;
+        n -= half;
+    }
+
+    return base - uhpd->peers->cumulative;
+}
+
+
+static ngx_uint_t
+ngx_http_upstream_myhash_position(ngx_http_upstream_myhash_peers_t *peers,
+    uint32_t hash)
+{
+    if (peers->ring) {
+        return ngx_http_upstream_myhash_find_point(peers, hash);
     }
 
-    w = uhpd->hash % uhpd->peers->total_weight;
+    return hash % ngx_http_upstream_myhash_positions(peers);
+}
+
+
+/*
+ * Ketama ring: every peer gets "ring" points per weight unit, four points
+ * per MD5 of "<name>-<n>".  Keys are looked up by their full CRC32, the
+ * first point at or after it wins, so adding or removing a peer only moves
+ * the keys that land next to its points.
+ */
 
-    for (i = 0; i < uhpd->peers->number; i++) {
-        w -= uhpd->peers->peer[i].weight;
-        if (w < 0) {
-            return i;
+static ngx_int_t
+ngx_http_upstream_myhash_init_ring(ngx_conf_t *cf,
+    ngx_http_upstream_myhash_peers_t *peers, ngx_uint_t vnodes)
+{
+    u_char                           *p;
+    u_char                            buf[NGX_SOCKADDR_STRLEN + NGX_INT_T_LEN + 1];
+    u_char                            md5[16];
+    ngx_md5_t                         ctx;
+    ngx_uint_t                        i, j, k, n, total;
+    ngx_http_upstream_myhash_point_t *points;
+
+    total = 0;
+
+    /* checked per peer first, so that the products cannot overflow */
+
+    for (i = 0; i < peers->number; i++) {
+        if ((ngx_uint_t) peers->peer[i].weight
+            > NGX_HTTP_UPSTREAM_MYHASH_MAX_POINTS / vnodes)
+        {
+            break;
         }
+
+        total += ngx_align(vnodes * peers->peer[i].weight, 4);
+
+        if (total > NGX_HTTP_UPSTREAM_MYHASH_MAX_POINTS) {
+            break;
+        }
+    }
+
+    if (i < peers->number) {
+        ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                      "myhash ring of more than %d points, "
+                      "lower \"ring=\" or the server weights",
+                      NGX_HTTP_UPSTREAM_MYHASH_MAX_POINTS);
+        return NGX_ERROR;
+    }
+
+    points = ngx_palloc(cf->temp_pool,
+                        sizeof(ngx_http_upstream_myhash_point_t) * total);
+    if (points == NULL) {
+        return NGX_ERROR;
+    }
+
+    n = 0;
+
+    for (i = 0; i < peers->number; i++) {
+        for (j = 0; j < ngx_align(vnodes * peers->peer[i].weight, 4) / 4; j++) {
+
+            p = ngx_snprintf(buf, sizeof(buf), "%V-%ui",
+                             &peers->peer[i].name, j);
+
+            ngx_md5_init(&ctx);
+            ngx_md5_update(&ctx, buf, p - buf);
+            ngx_md5_final(md5, &ctx);
+
+            for (k = 0; k < 4; k++) {
+                points[n].hash = (uint32_t) md5[3 + k * 4] << 24
+                                 | (uint32_t) md5[2 + k * 4] << 16
+                                 | (uint32_t) md5[1 + k * 4] << 8
+                                 | (uint32_t) md5[k * 4];
+                points[n].peer = i;
+                n++;
+            }
+        }
+    }
+
+    ngx_qsort(points, n, sizeof(ngx_http_upstream_myhash_point_t),
+              ngx_http_upstream_myhash_cmp_points);
+
+    /* hashes and owners are split so that the search only touches hashes */
+
+    peers->ring = ngx_palloc(cf->pool, sizeof(uint32_t) * n);
+    peers->ring_peer = ngx_palloc(cf->pool, sizeof(uint32_t) * n);
+
+    if (peers->ring == NULL || peers->ring_peer == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < n; i++) {
+        peers->ring[i] = points[i].hash;
+        peers->ring_peer[i] = points[i].peer;
+    }
+
+    peers->ring_points = n;
+
+    return NGX_OK;
+}
+
+
+static int ngx_libc_cdecl
+ngx_http_upstream_myhash_cmp_points(const void *one, const void *two)
+{
+    ngx_http_upstream_myhash_point_t *first =
+                                     (ngx_http_upstream_myhash_point_t *) one;
+    ngx_http_upstream_myhash_point_t *second =
+                                     (ngx_http_upstream_myhash_point_t *) two;
+
+    if (first->hash < second->hash) {
+        return -1;
+    }
+
+    if (first->hash > second->hash) {
+        return 1;
+    }
+
+    return (first->peer > second->peer) - (first->peer < second->peer);
+}
+
+
+static ngx_uint_t
+ngx_http_upstream_myhash_find_point(ngx_http_upstream_myhash_peers_t *peers,
+    uint32_t hash)
+{
+    ngx_uint_t   n, half;
+    uint32_t    *base;
+
+    base = peers->ring;
+    n = peers->ring_points;
+
+    /* first point >= hash, wrapping past the last one */
+
+    while (n > 1) {
+        half = n / 2;
+        base = (base[half - 1] < hash) ? base + half : base;
+        n -= half;
     }
 
-    /* unreachable */
+    if (*base < hash) {
+        return 0;
+    }
 
-    return 0;
+    return base - peers->ring;
 }
 
 
@@ -155,6 +368,7 @@ ngx_http_upstream_init_hash(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
     ngx_uint_t                       i, j, n, w;
     ngx_http_upstream_server_t      *server;
     ngx_http_upstream_myhash_peers_t  *peers;
+    ngx_http_upstream_myhash_conf_t   *uhcf;
 #if (NGX_HTTP_HEALTHCHECK)
     ngx_int_t                        health_index;
 #endif
@@ -174,9 +388,6 @@ ngx_http_upstream_init_hash(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
 
         n += server[i].naddrs;
         w += server[i].naddrs * server[i].weight;
-	fprintf(stderr, "addr %s\n", inet_ntoa(((struct sockaddr_in *)server[i].addrs[0].sockaddr)->sin_addr));
-	fprintf(stderr, "addr %d\n", (unsigned short)ntohs(((struct sockaddr_in *)server[i].addrs[0].sockaddr)->sin_port));
-	fprintf(stderr, "weight %d\n", (int)server[i].weight);
     }
 
     if (n == 0) {
@@ -190,9 +401,18 @@ ngx_http_upstream_init_hash(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
         return NGX_ERROR;
     }
 
+    uhcf = ngx_http_conf_upstream_srv_conf(us, ngx_http_upstream_myhash_module);
+
     peers->number = n;
     peers->weighted = (w != n);
     peers->total_weight = w;
+    peers->full_hash = uhcf->full_hash || uhcf->vnodes;
+    peers->stride = uhcf->stride;
+
+    peers->cumulative = ngx_palloc(cf->pool, sizeof(ngx_uint_t) * n);
+    if (peers->cumulative == NULL) {
+        return NGX_ERROR;
+    }
 
     n = 0;
     /* one hostname can have multiple IP addresses in DNS */
@@ -205,7 +425,8 @@ ngx_http_upstream_init_hash(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
             peers->peer[n].name = server[i].addrs[j].name;
             peers->peer[n].down = server[i].down;
             peers->peer[n].weight = server[i].weight;
-	    fprintf(stderr, "peer addr %s\n", inet_ntoa(((struct sockaddr_in *)server[i].addrs[j].sockaddr)->sin_addr));
+            peers->cumulative[n] = (n ? peers->cumulative[n - 1] : 0)
+                                   + server[i].weight;
 #if (NGX_HTTP_HEALTHCHECK)
             if (!server[i].down) {
                 health_index =
@@ -216,11 +437,25 @@ ngx_http_upstream_init_hash(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
                 }
                 peers->peer[n].health_index = health_index;
             }
+#endif
+#if (NGX_HTTP_UPSTREAM_HASH_CHECK)
+            peers->peer[n].check_index =
+                ngx_http_upstream_hash_check_add_peer(cf, us,
+                                                      &server[i].addrs[j]);
+            if (peers->peer[n].check_index == NGX_ERROR) {
+                return NGX_ERROR;
+            }
 #endif
             n++;
         }
     }
 
+    if (uhcf->vnodes
+        && ngx_http_upstream_myhash_init_ring(cf, peers, uhcf->vnodes) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
     us->peer.data = peers;
 
     return NGX_OK;
@@ -233,14 +468,12 @@ ngx_http_upstream_init_hash_peer(ngx_http_request_t *r,
 {
     ngx_http_upstream_myhash_peer_data_t     *uhpd;
     ngx_http_upstream_myhash_conf_t          *uhcf;
-    struct sockaddr_in 			     *sin;
-    u_char                                   *p;
 
     ngx_str_t val;
 
     uhcf = ngx_http_conf_upstream_srv_conf(us, ngx_http_upstream_myhash_module);
 
-    if (ngx_http_script_run(r, &val, uhcf->lengths, 0, uhcf->values) == NULL) {
+    if (ngx_http_upstream_hash_key_eval(r, &uhcf->key, &val) != NGX_OK) {
         return NGX_ERROR;
     }
 
@@ -264,21 +497,32 @@ ngx_http_upstream_init_hash_peer(ngx_http_request_t *r,
     r->upstream->peer.save_session = ngx_http_upstream_save_hash_peer_session;
 #endif
 
-    /* must be big enough for the retry keys */
-    if ((uhpd->current_key.data = ngx_pcalloc(r->pool, NGX_ATOMIC_T_LEN + val.len)) == NULL) {
-        return NGX_ERROR;
-    }
+    if (uhpd->peers->stride) {
+        /* retries step through the hash space, the key is never rebuilt */
+        uhpd->current_key.data = val.data;
 
-    sin = (struct sockaddr_in *) r->connection->sockaddr;
-    p = (u_char *) &sin->sin_addr.s_addr;
+    } else {
+        /* must be big enough for the retry keys */
+        if ((uhpd->current_key.data = ngx_pcalloc(r->pool, NGX_ATOMIC_T_LEN + val.len)) == NULL) {
+            return NGX_ERROR;
+        }
+    }
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "sockaddr sin %c", (char)p[0]);
+    if (!uhpd->peers->stride) {
+        ngx_memcpy(uhpd->current_key.data, val.data, val.len);
+    }
 
-    ngx_memcpy(uhpd->current_key.data, val.data, val.len);
     uhpd->current_key.len = val.len;
     uhpd->original_key = val;
-    uhpd->hash = ngx_http_upstream_myhash_crc32(uhpd->current_key.data, uhpd->current_key.len);
+    uhpd->hash = ngx_http_upstream_myhash_crc32(uhpd->peers,
+                                                uhpd->current_key.data,
+                                                uhpd->current_key.len);
+
+    if (uhpd->peers->stride) {
+        uhpd->stride = ngx_http_upstream_myhash_stride(uhpd->peers, uhpd->hash);
+        uhpd->hash = ngx_http_upstream_myhash_position(uhpd->peers, uhpd->hash);
+    }
+
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "upstream_myhash: hashed \"%V\" to %ui", &uhpd->current_key,
                    ngx_http_upstream_get_hash_peer_index(uhpd));
@@ -435,23 +679,88 @@ static void ngx_http_upstream_myhash_next_peer(ngx_http_upstream_myhash_peer_dat
         || uhpd->peers->peer[current].down
 #if (NGX_HTTP_HEALTHCHECK)
         || ngx_http_healthcheck_is_down(uhpd->peers->peer[current].health_index, log)
+#endif
+#if (NGX_HTTP_UPSTREAM_HASH_CHECK)
+        || (uhpd->peers->peer[current].check_index != NGX_DECLINED
+            && ngx_http_upstream_hash_check_peer_down(
+                   uhpd->peers->peer[current].check_index))
 #endif
         )) {
+       if (uhpd->peers->stride) {
+           uhpd->try_i++;
+           uhpd->hash += uhpd->stride;
+           if (uhpd->hash >= ngx_http_upstream_myhash_positions(uhpd->peers)) {
+               uhpd->hash -= ngx_http_upstream_myhash_positions(uhpd->peers);
+           }
+           current = ngx_http_upstream_get_hash_peer_index(uhpd);
+           ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+               "upstream_myhash: probe %ui to %ui", uhpd->try_i, current);
+           continue;
+       }
+
        uhpd->current_key.len = ngx_sprintf(uhpd->current_key.data, "%d%V",
            ++uhpd->try_i, &uhpd->original_key) - uhpd->current_key.data;
-       uhpd->hash += ngx_http_upstream_myhash_crc32(uhpd->current_key.data,
-           uhpd->current_key.len);
+       uhpd->hash += ngx_http_upstream_myhash_crc32(uhpd->peers,
+           uhpd->current_key.data, uhpd->current_key.len);
        current = ngx_http_upstream_get_hash_peer_index(uhpd);
        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
            "upstream_myhash: hashed \"%V\" to %ui", &uhpd->current_key, current);
    } 
 }
 
-/* bit-shift, bit-mask, and non-zero requirement are for libmemcache compatibility */
+/*
+ * double hashing over the lookup positions: the n-th retry lands on
+ * position + n * stride modulo their number, with the stride mixed out of
+ * the key hash (murmur3 finalizer) and bumped until it is coprime with that
+ * number, so the retries visit every position, and thus every peer, once
+ * before any repeats; m - 1 is always coprime with m, so the bump ends
+ */
+static uint32_t
+ngx_http_upstream_myhash_stride(ngx_http_upstream_myhash_peers_t *peers,
+    uint32_t hash)
+{
+    ngx_uint_t  m, s, a, b, t;
+
+    m = ngx_http_upstream_myhash_positions(peers);
+
+    if (m < 2) {
+        return 0;
+    }
+
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+
+    for (s = hash % (m - 1) + 1; /* void */; s++) {
+
+        for (a = m, b = s; b; a = b, b = t) {
+            t = a % b;
+        }
+
+        if (a == 1) {
+            return s;
+        }
+    }
+}
+
+/*
+ * bit-shift, bit-mask, and non-zero requirement are for libmemcache
+ * compatibility; the 15 bits left skew hash % total_weight once there are
+ * thousands of weight units, so "hash=full" keeps the whole CRC32
+ */
 static ngx_uint_t
-ngx_http_upstream_myhash_crc32(u_char *keydata, size_t keylen)
+ngx_http_upstream_myhash_crc32(ngx_http_upstream_myhash_peers_t *peers,
+    u_char *keydata, size_t keylen)
 {
-    ngx_uint_t crc32 = (ngx_crc32_short(keydata, keylen) >> 16) & 0x7fff;
+    ngx_uint_t crc32;
+
+    if (peers->full_hash) {
+        return ngx_crc32_long(keydata, keylen);
+    }
+
+    crc32 = (ngx_crc32_short(keydata, keylen) >> 16) & 0x7fff;
     return crc32 ? crc32 : 1;
 }
 
@@ -459,33 +768,22 @@ static char *
 ngx_http_upstream_myhash(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     ngx_http_upstream_srv_conf_t   *uscf;
-    ngx_http_script_compile_t       sc;
     ngx_str_t                      *value;
-    ngx_array_t                    *vars_lengths, *vars_values;
+    ngx_int_t                       n;
+    ngx_uint_t                      i;
     ngx_http_upstream_myhash_conf_t  *uhcf;
 
     value = cf->args->elts;
 
-    ngx_memzero(&sc, sizeof(ngx_http_script_compile_t));
-
-    fprintf(stderr, "hello myhash");
-
-    vars_lengths = NULL;
-    vars_values = NULL;
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
 
-    sc.cf = cf;
-    sc.source = &value[1];
-    sc.lengths = &vars_lengths;
-    sc.values = &vars_values;
-    sc.complete_lengths = 1;
-    sc.complete_values = 1;
+    /* "keepalive" must follow "myhash" to wrap it */
 
-    if (ngx_http_script_compile(&sc) != NGX_OK) {
-        return NGX_CONF_ERROR;
+    if (uscf->peer.init_upstream) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "load balancing method redefined");
     }
 
-    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
-
     uscf->peer.init_upstream = ngx_http_upstream_init_hash;
 
     uscf->flags = NGX_HTTP_UPSTREAM_CREATE
@@ -494,8 +792,61 @@ ngx_http_upstream_myhash(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     uhcf = ngx_http_conf_upstream_srv_conf(uscf, ngx_http_upstream_myhash_module);
 
-    uhcf->values = vars_values->elts;
-    uhcf->lengths = vars_lengths->elts;
+    if (ngx_http_upstream_hash_key_compile(cf, &value[1], &uhcf->key)
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strcmp(value[i].data, "hash=compat") == 0) {
+            uhcf->full_hash = 0;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "hash=full") == 0) {
+            uhcf->full_hash = 1;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "retry=rehash") == 0) {
+            uhcf->stride = 0;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "retry=stride") == 0) {
+            uhcf->stride = 1;
+            continue;
+        }
+
+        /* the ring is searched by the full CRC32 */
+
+        if (ngx_strcmp(value[i].data, "ring") == 0) {
+            uhcf->vnodes = NGX_HTTP_UPSTREAM_MYHASH_VNODES;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "ring=", 5) == 0) {
+            n = ngx_atoi(value[i].data + 5, value[i].len - 5);
+
+            if (n == NGX_ERROR || n == 0
+                || n > NGX_HTTP_UPSTREAM_MYHASH_MAX_VNODES)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid number of points \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            uhcf->vnodes = n;
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
 
     return NGX_CONF_OK;
 }
@@ -513,11 +864,12 @@ ngx_http_upstream_myhash_create_conf(ngx_conf_t *cf)
 
     /*
      * set by ngx_pcalloc():
-     *     conf->lengths;
-     *     conf->values = NULL;
+     *     conf->key.lengths = NULL;
+     *     conf->key.values = NULL;
      */
 
     conf->retries = 0;
+    conf->key.index = NGX_ERROR;
 
     return conf;
 }